@@ -0,0 +1,769 @@
+/*******************************************************************************
+*  The "New BSD License" : http://www.opensource.org/licenses/bsd-license.php  *
+********************************************************************************
+
+Copyright (c) 2025, Rudolf Farkas
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+******************************************************************************/
+
+#include "../src/simpler_svg.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
+
+using namespace svg;
+
+// Benchmarks for the serialization hot paths.
+//
+//   ./simpler_svg_bench [filter]
+//
+// Only benchmarks whose name contains the filter are run.  Each line reports
+// elements per second, output bytes per second and heap allocations per
+// element, averaged over enough repetitions to run for at least 0.2 s.
+
+static std::atomic<size_t> allocation_count{0};
+
+void *operator new(size_t size)
+{
+    ++allocation_count;
+    if (void *ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    ++allocation_count;
+    size_t align = std::max(size_t(alignment), sizeof(void *));
+    size_t rounded = (size + align - 1) / align * align;
+    if (void *ptr = std::aligned_alloc(align, rounded ? rounded : align))
+        return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+static const char *filter = "";
+
+// Runs body until at least min_seconds have elapsed.  body returns the number
+// of bytes it produced; elements is the number of elements per call.
+template <typename Body>
+void run(std::string const &name, size_t elements, Body body)
+{
+    if (name.find(filter) == std::string::npos) return;
+
+    using clock = std::chrono::steady_clock;
+    const double min_seconds = 0.2;
+
+    body();  // Warm up caches and buffers.
+
+    size_t iterations = 0;
+    size_t bytes = 0;
+    size_t allocations_before = allocation_count;
+    auto start = clock::now();
+    double elapsed = 0;
+    do
+    {
+        bytes += body();
+        ++iterations;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < min_seconds);
+    size_t allocations = allocation_count - allocations_before;
+
+    double total_elements = double(elements) * iterations;
+    std::printf("%-36s %14.0f elem/s %10.1f MB/s %10.3f allocs/elem\n",
+                name.c_str(), total_elements / elapsed,
+                bytes / elapsed / 1e6, allocations / total_elements);
+}
+
+// Serializes shape count times into a reused Writer.
+void runShape(std::string const &name, Shape const &shape, size_t count)
+{
+    Layout layout(Size(1000, 1000));
+    Writer writer;
+    run(name, count,
+        [&]
+        {
+            writer.clear();
+            for (size_t i = 0; i < count; ++i) shape.serialize(writer, layout);
+            return writer.size();
+        });
+}
+
+Polyline makeSeries(size_t count, double phase = 0)
+{
+    Polyline polyline(Stroke(.5, Color::Blue));
+    for (size_t i = 0; i < count; ++i)
+        polyline << Point(i * 0.01, 500 + 400 * std::sin(i * 0.001 + phase));
+    return polyline;
+}
+
+void benchShapes()
+{
+    const size_t count = 10000;
+    runShape("shape/circle",
+             Circle(Point(120.5, 80.25), 7, Fill(Color::Red),
+                    Stroke(1, Color::Black)),
+             count);
+    runShape("shape/elipse",
+             Elipse(Point(120.5, 80.25), 7, 3, Fill(Color::Red),
+                    Stroke(1, Color::Black)),
+             count);
+    runShape("shape/rectangle",
+             Rectangle(Point(120.5, 80.25), 30, 20, Fill(Color(10, 20, 30))),
+             count);
+    runShape("shape/line",
+             Line(Point(0, 0), Point(333.3, 444.4), Stroke(2, Color::Green)),
+             count);
+    runShape("shape/text",
+             Text(Point(20, 300), "Simple SVG", Font(20, "Verdana"),
+                  Fill(Color::Silver), Stroke(), 45),
+             count);
+
+    Polygon polygon(Fill(Color::Yellow), Stroke(.5, Color::Black));
+    Polyline polyline(Stroke(.5, Color::Black));
+    for (int i = 0; i < 8; ++i)
+    {
+        polygon << Point(i * 10.5, (i % 3) * 7.25);
+        polyline << Point(i * 10.5, (i % 3) * 7.25);
+    }
+    runShape("shape/polygon8", polygon, count);
+    runShape("shape/polyline8", polyline, count);
+}
+
+void benchPoints()
+{
+    for (size_t count = 1000; count <= 10000000; count *= 10)
+    {
+        Polyline polyline = makeSeries(count);
+        Polygon polygon(Fill(Color::Yellow));
+        for (Point const &point : polyline.points) polygon << point;
+
+        std::string suffix = "/" + std::to_string(count);
+        Layout layout(Size(1000, 1000));
+        Writer writer;
+        run("points/polyline" + suffix, count,
+            [&]
+            {
+                writer.clear();
+                polyline.serialize(writer, layout);
+                return writer.size();
+            });
+        run("points/polygon" + suffix, count,
+            [&]
+            {
+                writer.clear();
+                polygon.serialize(writer, layout);
+                return writer.size();
+            });
+    }
+}
+
+void benchPrecision()
+{
+    const size_t count = 1000000;
+    Polyline polyline = makeSeries(count);
+    Layout layout(Size(1000, 1000));
+    std::pair<std::string, Precision> precisions[] = {
+        {"significant6", Precision()},
+        {"decimals1", Precision::decimals(1)},
+        {"quantize8", Precision::quantize(8)}};
+    for (auto const &[name, precision] : precisions)
+    {
+        Writer writer;
+        writer.setPrecision(precision);
+        run("precision/" + name, count,
+            [&]
+            {
+                writer.clear();
+                polyline.serialize(writer, layout);
+                return writer.size();
+            });
+    }
+}
+
+void benchColors()
+{
+    const size_t count = 1000000;
+    Layout layout(Size(1000, 1000));
+    std::pair<std::string, ColorFormat> formats[] = {
+        {"rgb", ColorFormat::Rgb}, {"hex", ColorFormat::Hex}};
+    for (auto const &[name, format] : formats)
+    {
+        Writer writer;
+        writer.setColorFormat(format);
+        run("color/" + name, count,
+            [&]
+            {
+                writer.clear();
+                for (size_t i = 0; i < count; ++i)
+                    Color(int(i & 255), 128, 64).serialize(writer, layout);
+                return writer.size();
+            });
+    }
+}
+
+// Bytes per point are reported as MB/s divided by elem/s.
+void benchEncoding()
+{
+    const size_t count = 1000000;
+    Polyline polyline = makeSeries(count);
+    Layout layout(Size(1000, 1000));
+    for (Precision precision : {Precision(), Precision::decimals(1)})
+    {
+        std::string suffix =
+            precision.mode == Precision::Significant ? "" : "/decimals1";
+        for (PointEncoding encoding :
+             {PointEncoding::Points, PointEncoding::Path})
+        {
+            polyline.setEncoding(encoding);
+            Writer writer;
+            writer.setPrecision(precision);
+            run(std::string("encoding/") +
+                    (encoding == PointEncoding::Path ? "path" : "points") +
+                    suffix,
+                count,
+                [&]
+                {
+                    writer.clear();
+                    polyline.serialize(writer, layout);
+                    return writer.size();
+                });
+        }
+    }
+}
+
+void benchSimplify()
+{
+    const size_t count = 1000000;
+    Polyline polyline = makeSeries(count);
+    Layout layout(Size(1000, 1000));
+    run("simplify/polyline/" + std::to_string(count), count,
+        [&]
+        {
+            return simplifyVisvalingam(polyline.points,
+                                       simplifyArea(0.5, layout))
+                       .size() *
+                   sizeof(Point);
+        });
+
+    std::vector<Polyline> polylines(64, makeSeries(count / 64));
+    run("simplify/parallel/64x" + std::to_string(count / 64), count,
+        [&]
+        {
+            std::vector<Polyline> copies = polylines;
+            simplifyShapes(copies, 0.5, layout);
+            return size_t(0);
+        });
+}
+
+// Group nested depth levels deep, with one circle at each level.
+Group makeNested(size_t depth)
+{
+    Group group("level");
+    if (depth > 1) group << makeNested(depth - 1);
+    group << Circle(Point(depth, depth), 2, Fill(Color::Red));
+    return group;
+}
+
+void benchGroups()
+{
+    Layout layout(Size(1000, 1000));
+    Writer writer;
+
+    const size_t width = 100000;
+    Group wide("wide");
+    for (size_t i = 0; i < width; ++i)
+        wide << Circle(Point(i % 1000, i / 100), 2, Fill(Color::Red));
+    run("group/wide/serialize", width,
+        [&]
+        {
+            writer.clear();
+            wide.serialize(writer, layout);
+            return writer.size();
+        });
+    run("group/wide/serialize/parallel", width,
+        [&]
+        {
+            writer.clear();
+            wide.serialize(writer, layout, defaultThreadPool());
+            return writer.size();
+        });
+    // Zoomed in 10x, so about 1% of the circles are on the canvas.
+    Layout zoomed(Size(1000, 1000), 10);
+    Group culled(wide);
+    culled.setCulling(true);
+    run("group/wide/zoomed", width,
+        [&]
+        {
+            writer.clear();
+            wide.serialize(writer, zoomed);
+            return writer.size();
+        });
+    run("group/wide/zoomed/culled", width,
+        [&]
+        {
+            writer.clear();
+            culled.serialize(writer, zoomed);
+            return writer.size();
+        });
+    run("group/wide/index/build", width,
+        [&]
+        {
+            SpatialIndex index(wide, zoomed);
+            return size_t(0);
+        });
+    SpatialIndex index(wide, zoomed);
+    run("group/wide/index/serialize", width,
+        [&]
+        {
+            writer.clear();
+            index.serialize(writer, canvasBox(zoomed));
+            return writer.size();
+        });
+    run("group/wide/copy", width,
+        [&]
+        {
+            Group copy(wide);
+            return size_t(0);
+        });
+
+    Polyline tick(Stroke(1, Color::Black));
+    tick << Point(0, 0) << Point(0, 5) << Point(3, 5);
+    run("group/build/heap", width,
+        [&]
+        {
+            Group scene;
+            for (size_t i = 0; i < width / 2; ++i)
+                scene << tick << Circle(Point(i, i), 2, Fill(Color::Red));
+            return size_t(0);
+        });
+    run("group/build/arena", width,
+        [&]
+        {
+            std::pmr::monotonic_buffer_resource arena;
+            Group scene("", &arena);
+            for (size_t i = 0; i < width / 2; ++i)
+                scene << tick << Circle(Point(i, i), 2, Fill(Color::Red));
+            return size_t(0);
+        });
+
+    const size_t depth = 200;
+    Group deep = makeNested(depth);
+    run("group/deep/serialize", depth,
+        [&]
+        {
+            writer.clear();
+            deep.serialize(writer, layout);
+            return writer.size();
+        });
+    run("group/deep/copy", depth,
+        [&]
+        {
+            Group copy(deep);
+            return size_t(0);
+        });
+}
+
+// The same mixed shapes in a pointer-based Group and in a ValueGroup.
+template <typename G>
+void benchMixed(std::string const &name)
+{
+    const size_t count = 100000;
+    Layout layout(Size(1000, 1000));
+    auto build = [&]
+    {
+        G group;
+        for (size_t i = 0; i < count; ++i)
+        {
+            Point point(i % 1000, i / 100);
+            if (i % 2)
+                group << Circle(point, 4, Fill(Color::Red));
+            else
+                group << Rectangle(point, 4, 4, Fill(Color::Blue),
+                                   Stroke(1, Color::Black));
+        }
+        return group;
+    };
+    run(name + "/build", count,
+        [&]
+        {
+            G group = build();
+            return size_t(0);
+        });
+
+    G group = build();
+    Writer writer;
+    run(name + "/serialize", count,
+        [&]
+        {
+            writer.clear();
+            group.serialize(writer, layout);
+            return writer.size();
+        });
+    run(name + "/offset", count,
+        [&]
+        {
+            group.offset(Point(1, 1));
+            return size_t(0);
+        });
+    run(name + "/bounds", count,
+        [&]
+        {
+            return size_t(group.bounds(layout)->max.x > 0);
+        });
+}
+
+// A million-point scatter plot as Circles in a Group and as a CircleBatch.
+void benchScatter()
+{
+    const size_t count = 1000000;
+    Layout layout(Size(1000, 1000));
+    auto point = [](size_t i)
+    { return Point((i * 7919) % 1000 + 0.5, (i * 104729) % 1000 + 0.25); };
+    Writer writer;
+
+    run("scatter/circles/build", count,
+        [&]
+        {
+            Group group;
+            for (size_t i = 0; i < count; ++i)
+                group << Circle(point(i), 3, Fill(Color::Red));
+            return size_t(0);
+        });
+    Group group;
+    for (size_t i = 0; i < count; ++i)
+        group << Circle(point(i), 3, Fill(Color::Red));
+    run("scatter/circles/serialize", count,
+        [&]
+        {
+            writer.clear();
+            group.serialize(writer, layout);
+            return writer.size();
+        });
+
+    run("scatter/batch/build", count,
+        [&]
+        {
+            CircleBatch batch(Fill(Color::Red));
+            batch.reserve(count);
+            for (size_t i = 0; i < count; ++i) batch.add(point(i), 3);
+            return size_t(0);
+        });
+    CircleBatch batch(Fill(Color::Red));
+    for (size_t i = 0; i < count; ++i) batch.add(point(i), 3);
+    run("scatter/batch/serialize", count,
+        [&]
+        {
+            writer.clear();
+            batch.serialize(writer, layout);
+            return writer.size();
+        });
+}
+
+void benchLineChart()
+{
+    const size_t series = 50;
+    const size_t points = 10000;
+    LineChart chart(Size(10, 10), 1);
+    for (size_t i = 0; i < series; ++i) chart << makeSeries(points, i);
+
+    Layout layout(Size(1000, 1000));
+    Writer writer;
+    std::string name =
+        "linechart/" + std::to_string(series) + "x" + std::to_string(points);
+    run(name, series * points,
+        [&]
+        {
+            writer.clear();
+            chart.serialize(writer, layout);
+            return writer.size();
+        });
+
+    chart.setDownsampling(1);
+    run(name + "/lttb", series * points,
+        [&]
+        {
+            writer.clear();
+            chart.serialize(writer, layout);
+            return writer.size();
+        });
+
+    chart.setLevelOfDetail(true);
+    run(name + "/lod", series * points,
+        [&]
+        {
+            writer.clear();
+            chart.serialize(writer, layout);
+            return writer.size();
+        });
+    // A 100x zoom onto the middle of the series.
+    Layout zoomed(Size(1000, 1000), 100, Point(-0.005 * points, 0));
+    run(name + "/lod/zoomed", series * points,
+        [&]
+        {
+            writer.clear();
+            chart.serialize(writer, zoomed);
+            return writer.size();
+        });
+}
+
+// Alternating circles and stroked rectangles, as in a typical chart.
+template <typename Doc>
+void addShapes(Doc &doc, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        Point point(i % 1000, (i / 1000) * 10.0);
+        if (i % 2)
+            doc << Circle(point, 4, Fill(Color::Red));
+        else
+            doc << Rectangle(point, 4, 4, Fill(Color::Blue),
+                             Stroke(1, Color::Black));
+    }
+}
+
+void benchDocument()
+{
+    const size_t count = 100000;
+    const char *file_name = "simpler_svg_bench.svg";
+    Layout layout(Size(1000, 1000));
+    run("document/save", count,
+        [&]
+        {
+            Document doc(file_name, layout);
+            addShapes(doc, count);
+            doc.save();
+            return size_t(std::filesystem::file_size(file_name));
+        });
+    {
+        // Each document is written while the next one is built.
+        FileWriter io;
+        std::future<SaveResult> previous;
+        run("document/save/async", count,
+            [&]
+            {
+                Document doc(file_name, layout);
+                addShapes(doc, count);
+                size_t bytes =
+                    previous.valid() ? previous.get().bytes_written : 0;
+                previous = doc.saveAsync(io);
+                return bytes;
+            });
+        if (previous.valid()) previous.get();
+    }
+    run("document/build", count,
+        [&]
+        {
+            Document doc(file_name, layout);
+            addShapes(doc, count);
+            return doc.toString().size();
+        });
+    run("document/build/interned", count,
+        [&]
+        {
+            Document doc(file_name, layout);
+            doc.setStyleInterning(true);
+            addShapes(doc, count);
+            return doc.toString().size();
+        });
+    run("document/streaming", count,
+        [&]
+        {
+            {
+                StreamingDocument doc(file_name, layout);
+                addShapes(doc, count);
+            }
+            return size_t(std::filesystem::file_size(file_name));
+        });
+#ifdef SIMPLER_SVG_USE_ZLIB
+    // Bytes are the compressed size.
+    run("document/save/svgz", count,
+        [&]
+        {
+            Document doc(file_name, layout);
+            addShapes(doc, count);
+            doc.saveCompressed();
+            return size_t(std::filesystem::file_size(file_name));
+        });
+#endif
+    std::remove(file_name);
+}
+
+// A dashboard of 50 series where one changes between renders.
+void benchRetained()
+{
+    const size_t series = 50;
+    const size_t points = 10000;
+    Layout layout(Size(1000, 1000));
+    std::vector<Polyline> polylines;
+    for (size_t i = 0; i < series; ++i)
+        polylines.push_back(makeSeries(points, double(i)));
+
+    size_t changed = 0;
+    run("retained/rebuild", series * points,
+        [&]
+        {
+            polylines[changed++ % series].offset(Point(0, 1));
+            Document doc("unused.svg", layout);
+            for (Polyline const &polyline : polylines) doc << polyline;
+            return doc.toString().size();
+        });
+
+    RetainedDocument retained("unused.svg", layout);
+    std::vector<std::shared_ptr<Polyline>> handles;
+    for (Polyline const &polyline : polylines)
+        handles.push_back(retained.insert(polyline));
+    run("retained/one_changed", series * points,
+        [&]
+        {
+            handles[changed++ % series]->offset(Point(0, 1));
+            return retained.toString().size();
+        });
+}
+
+// Frames of a chart whose background of 10000 shapes never changes and
+// whose single moving marker does.  Element counts are frames.
+void benchFrames()
+{
+    const size_t frames = 100;
+    Layout layout(Size(1000, 1000));
+    Group background("background");
+    for (size_t i = 0; i < 10000; ++i)
+        background << Circle(Point(i % 1000, i / 10), 2, Fill(Color::Silver));
+    auto draw = [](size_t frame, Group &layer)
+    { layer << Circle(Point(frame * 10, 500), 8, Fill(Color::Red)); };
+
+    run("frames/documents", frames,
+        [&]
+        {
+            size_t bytes = 0;
+            for (size_t frame = 0; frame < frames; ++frame)
+            {
+                Group marker("marker");
+                draw(frame, marker);
+                Document doc("unused.svg", layout);
+                doc << background << marker;
+                bytes += doc.toString().size();
+            }
+            return bytes;
+        });
+    FrameSequence sequence(layout);
+    sequence.addStatic(background).addDynamic("marker", draw);
+    run("frames/sequence", frames,
+        [&]
+        {
+            std::vector<size_t> bytes(frames);
+            defaultThreadPool().parallelFor(
+                frames, [&](size_t frame)
+                { bytes[frame] = sequence.frameToString(frame).size(); });
+            size_t total = 0;
+            for (size_t size : bytes) total += size;
+            return total;
+        });
+    run("frames/animation", frames,
+        [&] { return sequence.animationToString(frames, 0.04).size(); });
+}
+
+// Element counts are tiles.
+void benchTiles()
+{
+    const size_t count = 100000;
+    Layout layout(Size(4096, 4096));
+    Group scene("scene");
+    for (size_t i = 0; i < count; ++i)
+        scene << Circle(Point((i * 7919) % 4096, (i * 104729) % 4096), 6,
+                        Fill(Color::Red));
+    Tiler tiler(scene, layout, Size(256, 256));
+    const size_t tiles = tiler.columns() * tiler.rows();
+    run("tiles/naive", tiles,
+        [&]
+        {
+            // One culled document per tile, each walking the whole scene.
+            size_t bytes = 0;
+            Group culled(scene);
+            culled.setCulling(true);
+            for (size_t row = 0; row < tiler.rows(); ++row)
+                for (size_t column = 0; column < tiler.columns(); ++column)
+                {
+                    Document doc("unused.svg",
+                                 regionLayout(layout,
+                                              tiler.tileBox(column, row)));
+                    doc << culled;
+                    bytes += doc.toString().size();
+                }
+            return bytes;
+        });
+    run("tiles/index", tiles,
+        [&]
+        {
+            Tiler indexed(scene, layout, Size(256, 256));
+            std::vector<size_t> bytes(tiles);
+            defaultThreadPool().parallelFor(
+                tiles,
+                [&](size_t tile)
+                {
+                    bytes[tile] = indexed
+                                      .tileToString(tile % indexed.columns(),
+                                                    tile / indexed.columns())
+                                      .size();
+                });
+            size_t total = 0;
+            for (size_t size : bytes) total += size;
+            return total;
+        });
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1) filter = argv[1];
+
+    benchShapes();
+    benchPoints();
+    benchPrecision();
+    benchColors();
+    benchEncoding();
+    benchSimplify();
+    benchGroups();
+    benchMixed<Group>("mixed/group");
+    benchMixed<ValueGroup>("mixed/valuegroup");
+    benchMixed<BasicValueGroup<Circle, Rectangle>>("mixed/valuegroup2");
+    benchScatter();
+    benchLineChart();
+    benchDocument();
+    benchRetained();
+    benchFrames();
+    benchTiles();
+    return 0;
+}
@@ -33,13 +33,51 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef SIMPLE_SVG_HPP
 #define SIMPLE_SVG_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <optional>
+#include <queue>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <variant>
 #include <vector>
 
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define SIMPLER_SVG_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SIMPLER_SVG_POSIX_IO 1
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+// Define SIMPLER_SVG_USE_ZLIB and link zlib for compressed (.svgz) output.
+#ifdef SIMPLER_SVG_USE_ZLIB
+#include <zlib.h>
+#endif
+
 namespace svg
 {
 // Utility XML/String Functions.
@@ -61,6 +99,201 @@ std::string elemEnd(std::string const &element_name)
 }
 std::string emptyElemEnd() { return "/>\n"; }
 
+// How a Writer prints coordinates and other non-integer numbers.
+struct Precision
+{
+    enum Mode
+    {
+        // Significant digits, as std::ostream prints them ("%g").
+        Significant,
+        // Rounded to a number of decimals (0-6).
+        Decimals,
+        // Rounded to the nearest 1/steps, printed as the shortest text that
+        // reads back exactly; steps should be a power of 2 or of 10.
+        Quantize
+    };
+
+    explicit Precision(Mode mode = Significant, int value = 6)
+        : mode(mode), value(value)
+    {
+    }
+    static Precision decimals(int count)
+    {
+        return Precision(Decimals, std::clamp(count, 0, 6));
+    }
+    static Precision quantize(int steps)
+    {
+        return Precision(Quantize, std::max(steps, 1));
+    }
+
+    Mode mode;
+    int value;
+};
+
+// Rgb is rgb(r,g,b) (rgba(r,g,b,a) with alpha); Hex is the shortest of
+// #rgb and #rrggbb (#rgba and #rrggbbaa with alpha), about half as long.
+enum class ColorFormat
+{
+    Rgb,
+    Hex
+};
+
+class StyleSheet;
+
+// Output buffer the serializers append to.  Numbers are formatted with
+// std::to_chars, so once the buffer has grown, appending does not allocate.
+class Writer
+{
+   public:
+    explicit Writer(size_t reserve = 0) { buffer.reserve(reserve); }
+
+    // Decimals and Quantize also drop trailing zeros and the leading 0 of
+    // numbers between -1 and 1, so 0.50 prints as .5.
+    void setPrecision(Precision const &new_precision)
+    {
+        precision = new_precision;
+    }
+    Precision const &getPrecision() const { return precision; }
+    // With a style sheet, shapes write a class attribute naming their fill,
+    // stroke and font, interned in sheet, instead of the attributes.
+    void setStyleSheet(StyleSheet *sheet) { style_sheet = sheet; }
+    StyleSheet *getStyleSheet() const { return style_sheet; }
+    void setColorFormat(ColorFormat format) { color_format = format; }
+    ColorFormat getColorFormat() const { return color_format; }
+    // Takes the number and color formatting of other, e.g. for a buffer
+    // whose text is appended to other.
+    void setFormat(Writer const &other)
+    {
+        precision = other.precision;
+        color_format = other.color_format;
+    }
+
+    Writer &operator<<(std::string_view text)
+    {
+        buffer.append(text);
+        return *this;
+    }
+    Writer &operator<<(char c)
+    {
+        buffer.push_back(c);
+        return *this;
+    }
+    Writer &operator<<(int value)
+    {
+        char chars[16];
+        auto result = std::to_chars(chars, chars + sizeof(chars), value);
+        buffer.append(chars, result.ptr);
+        return *this;
+    }
+    // Formats according to the precision; by default the same text as
+    // std::ostream's default formatting ("%g").
+    Writer &operator<<(double value)
+    {
+        char chars[max_number_size];
+        buffer.append(chars, formatNumber(chars, value));
+        return *this;
+    }
+    // Longest "%f" text of a double with six decimals.
+    static constexpr size_t max_number_size = 352;
+    // Writes value as operator<< would to out, which must have room for
+    // max_number_size chars.  Returns the end of the text.
+    char *formatNumber(char *out, double value) const
+    {
+        char *last = out + max_number_size;
+        switch (precision.mode)
+        {
+            case Precision::Significant:
+                return std::to_chars(out, last, value,
+                                     std::chars_format::general,
+                                     precision.value)
+                    .ptr;
+            case Precision::Decimals:
+                return trimNumber(out, std::to_chars(out, last, value,
+                                                     std::chars_format::fixed,
+                                                     precision.value)
+                                           .ptr);
+            default:
+                double steps = precision.value;
+                return trimNumber(
+                    out,
+                    std::to_chars(out, last, std::round(value * steps) / steps)
+                        .ptr);
+        }
+    }
+    // With the default precision, the same text as std::to_string(double)
+    // ("%f"); otherwise the same as operator<<(double).
+    Writer &fixed(double value)
+    {
+        if (precision.mode != Precision::Significant) return *this << value;
+
+        char chars[max_number_size];
+        auto result = std::to_chars(chars, chars + sizeof(chars), value,
+                                    std::chars_format::fixed, 6);
+        buffer.append(chars, result.ptr);
+        return *this;
+    }
+
+    Writer &attribute(std::string_view name, double value,
+                      std::string_view unit = "")
+    {
+        return *this << name << "=\"" << value << unit << "\" ";
+    }
+    Writer &attribute(std::string_view name, std::string_view value)
+    {
+        return *this << name << "=\"" << value << "\" ";
+    }
+    Writer &elemStart(std::string_view element_name)
+    {
+        return *this << "\t<" << element_name << ' ';
+    }
+    Writer &elemEnd(std::string_view element_name)
+    {
+        return *this << "</" << element_name << ">\n";
+    }
+    Writer &emptyElemEnd() { return *this << "/>\n"; }
+
+    const std::string &str() const { return buffer; }
+    const char *data() const { return buffer.data(); }
+    size_t size() const { return buffer.size(); }
+    bool empty() const { return buffer.empty(); }
+    // Empties the buffer but keeps its capacity for reuse.
+    void clear() { buffer.clear(); }
+    std::string take() { return std::move(buffer); }
+    // Exchanges the buffer with text, e.g. to reuse the storage of one
+    // that has been written out.
+    void swap(std::string &text) { buffer.swap(text); }
+
+   private:
+    std::string buffer;
+    Precision precision;
+    StyleSheet *style_sheet = nullptr;
+    ColorFormat color_format = ColorFormat::Rgb;
+
+    // Removes trailing zeros after the decimal point and the 0 before it
+    // from the number in [first, last).  Returns the new end.
+    static char *trimNumber(char *first, char *last)
+    {
+        if (std::find(first, last, 'e') == last &&
+            std::find(first, last, '.') != last)
+        {
+            while (last[-1] == '0') --last;
+            if (last[-1] == '.') --last;
+        }
+        char *digits = first + (*first == '-');
+        if (last - digits > 1 && digits[0] == '0' && digits[1] == '.')
+        {
+            std::copy(digits + 1, last, digits);
+            --last;
+        }
+        if (last - first == 2 && first[0] == '-' && first[1] == '0')
+        {
+            first[0] = '0';
+            --last;
+        }
+        return last;
+    }
+};
+
 struct Size
 {
     Size(double width, double height) : width(width), height(height) {}
@@ -75,29 +308,134 @@ struct Point
     double x;
     double y;
 };
-std::optional<Point> getMinPoint(std::vector<Point> const &points)
+
+// Batch kernels over arrays of points.  The SSE2/AVX2 variants are chosen at
+// run time and give the same results as the scalar ones (the AVX2 reduction
+// may return -0 for +0 or the reverse, as they compare equal).
+namespace detail
 {
-    if (points.empty()) return std::nullopt;
+static_assert(sizeof(Point) == 2 * sizeof(double),
+              "Point arrays are processed as packed x,y doubles");
+
+enum class SimdLevel
+{
+    Scalar,
+    SSE2,
+    AVX2
+};
+SimdLevel simdLevel()
+{
+    static const SimdLevel level = []
+    {
+#ifdef SIMPLER_SVG_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+        return SimdLevel::SSE2;
+#else
+        return SimdLevel::Scalar;
+#endif
+    }();
+    return level;
+}
 
-    Point min = points[0];
-    for (unsigned i = 0; i < points.size(); ++i)
+// Element-wise minimum (Max = false) or maximum of count > 0 points.
+// A coordinate that does not compare less (greater) than the running value
+// is skipped, so the first of equal values wins and NaNs after the first
+// point are ignored.
+template <bool Max>
+Point reducePointsScalar(Point const *points, size_t count)
+{
+    Point result = points[0];
+    for (size_t i = 1; i < count; ++i)
     {
-        if (points[i].x < min.x) min.x = points[i].x;
-        if (points[i].y < min.y) min.y = points[i].y;
+        if (Max ? points[i].x > result.x : points[i].x < result.x)
+            result.x = points[i].x;
+        if (Max ? points[i].y > result.y : points[i].y < result.y)
+            result.y = points[i].y;
     }
-    return min;
+    return result;
 }
-std::optional<Point> getMaxPoint(std::vector<Point> const &points)
+
+#ifdef SIMPLER_SVG_X86_SIMD
+// minpd/maxpd return their second operand unless the first compares
+// less/greater, which matches the scalar loop when the running value is
+// passed second.
+template <bool Max>
+__m128d reduceStep(__m128d next, __m128d running)
 {
-    if (points.empty()) return std::nullopt;
+    return Max ? _mm_max_pd(next, running) : _mm_min_pd(next, running);
+}
+
+template <bool Max>
+Point reducePointsSSE2(Point const *points, size_t count)
+{
+    const double *data = &points[0].x;
+    __m128d result = _mm_loadu_pd(data);
+    for (size_t i = 1; i < count; ++i)
+        result = reduceStep<Max>(_mm_loadu_pd(data + 2 * i), result);
+
+    Point point;
+    _mm_storeu_pd(&point.x, result);
+    return point;
+}
+
+template <bool Max>
+__attribute__((target("avx2"))) Point reducePointsAVX2(Point const *points,
+                                                       size_t count)
+{
+    if (count < 4) return reducePointsSSE2<Max>(points, count);
+
+    // Odd and even points are reduced in the low and high lanes, both
+    // starting from the first point so that a NaN there is the result, as
+    // in the scalar loop, and a NaN later is skipped.
+    const double *data = &points[0].x;
+    __m256d running = _mm256_broadcast_pd(
+        reinterpret_cast<__m128d const *>(data));
+    size_t i = 1;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m256d next = _mm256_loadu_pd(data + 2 * i);
+        running = Max ? _mm256_max_pd(next, running)
+                      : _mm256_min_pd(next, running);
+    }
+    __m128d result = reduceStep<Max>(_mm256_extractf128_pd(running, 1),
+                                     _mm256_castpd256_pd128(running));
+    if (i < count) result = reduceStep<Max>(_mm_loadu_pd(data + 2 * i), result);
+
+    Point point;
+    _mm_storeu_pd(&point.x, result);
+    return point;
+}
+#endif
 
-    Point max = points[0];
-    for (unsigned i = 0; i < points.size(); ++i)
+template <bool Max>
+Point reducePoints(Point const *points, size_t count)
+{
+    switch (simdLevel())
     {
-        if (points[i].x > max.x) max.x = points[i].x;
-        if (points[i].y > max.y) max.y = points[i].y;
+#ifdef SIMPLER_SVG_X86_SIMD
+        case SimdLevel::AVX2:
+            return reducePointsAVX2<Max>(points, count);
+        case SimdLevel::SSE2:
+            return reducePointsSSE2<Max>(points, count);
+#endif
+        default:
+            return reducePointsScalar<Max>(points, count);
     }
-    return max;
+}
+}  // namespace detail
+
+std::optional<Point> getMinPoint(std::span<const Point> points)
+{
+    if (points.empty()) return std::nullopt;
+
+    return detail::reducePoints<false>(points.data(), points.size());
+}
+std::optional<Point> getMaxPoint(std::span<const Point> points)
+{
+    if (points.empty()) return std::nullopt;
+
+    return detail::reducePoints<true>(points.data(), points.size());
 }
 
 // Defines the size, scale, origin, and origin offset of the document.
@@ -128,13 +466,308 @@ double translateScale(double dimension, Layout const &layout)
     return dimension * layout.scale;
 }
 
+// Axis-aligned rectangle in SVG native space (y pointing down).
+struct Box
+{
+    Box(Point const &min, Point const &max) : min(min), max(max) {}
+    // Smallest box holding both points.
+    static Box spanning(Point const &a, Point const &b)
+    {
+        return Box(Point(std::min(a.x, b.x), std::min(a.y, b.y)),
+                   Point(std::max(a.x, b.x), std::max(a.y, b.y)));
+    }
+
+    bool intersects(Box const &other) const
+    {
+        return min.x <= other.max.x && other.min.x <= max.x &&
+               min.y <= other.max.y && other.min.y <= max.y;
+    }
+    bool contains(Point const &point) const
+    {
+        return min.x <= point.x && point.x <= max.x && min.y <= point.y &&
+               point.y <= max.y;
+    }
+    Box &expand(double margin)
+    {
+        min.x -= margin;
+        min.y -= margin;
+        max.x += margin;
+        max.y += margin;
+        return *this;
+    }
+    Box &merge(Box const &other)
+    {
+        min.x = std::min(min.x, other.min.x);
+        min.y = std::min(min.y, other.min.y);
+        max.x = std::max(max.x, other.max.x);
+        max.y = std::max(max.y, other.max.y);
+        return *this;
+    }
+
+    Point min;
+    Point max;
+};
+
+// Visible area of a layout.
+Box canvasBox(Layout const &layout)
+{
+    return Box(Point(0, 0), Point(layout.size.width, layout.size.height));
+}
+// Box covering the user space rectangle between corners a and b.
+Box translateBox(Point const &a, Point const &b, Layout const &layout)
+{
+    return Box::spanning(
+        Point(translateX(a.x, layout), translateY(a.y, layout)),
+        Point(translateX(b.x, layout), translateY(b.y, layout)));
+}
+
+namespace detail
+{
+void translatePointsScalar(Point const *points, size_t count,
+                           Layout const &layout, double *out)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        out[2 * i] = translateX(points[i].x, layout);
+        out[2 * i + 1] = translateY(points[i].y, layout);
+    }
+}
+
+#ifdef SIMPLER_SVG_X86_SIMD
+// Same operations in the same order as translateX/translateY, and no FMA, so
+// the results are bit-identical.
+void translatePointsSSE2(Point const *points, size_t count,
+                         Layout const &layout, double *out)
+{
+    const double *data = &points[0].x;
+    const __m128d offset =
+        _mm_set_pd(layout.origin_offset.y, layout.origin_offset.x);
+    const __m128d scale = _mm_set1_pd(layout.scale);
+    const __m128d height = _mm_set1_pd(layout.size.height);
+    for (size_t i = 0; i < count; ++i)
+    {
+        __m128d scaled =
+            _mm_mul_pd(_mm_add_pd(_mm_loadu_pd(data + 2 * i), offset), scale);
+        // x from scaled, y from height - scaled.
+        _mm_storeu_pd(out + 2 * i,
+                      _mm_move_sd(_mm_sub_pd(height, scaled), scaled));
+    }
+}
+
+__attribute__((target("avx2"))) void translatePointsAVX2(
+    Point const *points, size_t count, Layout const &layout, double *out)
+{
+    const double *data = &points[0].x;
+    const __m256d offset =
+        _mm256_set_pd(layout.origin_offset.y, layout.origin_offset.x,
+                      layout.origin_offset.y, layout.origin_offset.x);
+    const __m256d scale = _mm256_set1_pd(layout.scale);
+    const __m256d height = _mm256_set1_pd(layout.size.height);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2)
+    {
+        __m256d scaled = _mm256_mul_pd(
+            _mm256_add_pd(_mm256_loadu_pd(data + 2 * i), offset), scale);
+        _mm256_storeu_pd(
+            out + 2 * i,
+            _mm256_blend_pd(scaled, _mm256_sub_pd(height, scaled), 0b1010));
+    }
+    if (i < count) translatePointsScalar(points + i, 1, layout, out + 2 * i);
+}
+#endif
+}  // namespace detail
+
+// Convert count points to SVG native space, writing x0, y0, x1, y1, ... to
+// out, which must have room for 2 * count doubles.
+void translatePoints(Point const *points, size_t count, Layout const &layout,
+                     double *out)
+{
+    switch (detail::simdLevel())
+    {
+#ifdef SIMPLER_SVG_X86_SIMD
+        case detail::SimdLevel::AVX2:
+            return detail::translatePointsAVX2(points, count, layout, out);
+        case detail::SimdLevel::SSE2:
+            return detail::translatePointsSSE2(points, count, layout, out);
+#endif
+        default:
+            return detail::translatePointsScalar(points, count, layout, out);
+    }
+}
+
+// Fixed set of worker threads.  Each worker takes tasks from the back of its
+// own queue and, when that is empty, steals from the front of the others'.
+class ThreadPool
+{
+   public:
+    explicit ThreadPool(
+        size_t thread_count = std::max(1u, std::thread::hardware_concurrency()))
+        : queues(std::max<size_t>(1, thread_count))
+    {
+        for (size_t i = 0; i < queues.size(); ++i)
+            workers.emplace_back([this, i] { workerLoop(i); });
+    }
+    ThreadPool(ThreadPool const &) = delete;
+    ThreadPool &operator=(ThreadPool const &) = delete;
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers) worker.join();
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Calls function(i) for i in [0, count), split into chunks that run on
+    // the workers and on the calling thread.  Returns when all calls are
+    // done.  function must not throw.
+    template <typename Function>
+    void parallelFor(size_t count, Function const &function)
+    {
+        if (count == 0) return;
+
+        const size_t chunk_count = std::min(count, 4 * size());
+        const size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+        std::atomic<size_t> remaining{(count + chunk_size - 1) / chunk_size};
+        std::mutex done_mutex;
+        std::condition_variable done;
+        for (size_t first = 0; first < count; first += chunk_size)
+        {
+            size_t last = std::min(count, first + chunk_size);
+            push(
+                [&, first, last]
+                {
+                    for (size_t i = first; i < last; ++i) function(i);
+                    // Under the lock, so the caller cannot see the last
+                    // chunk done and destroy done_mutex before it returns.
+                    std::lock_guard<std::mutex> lock(done_mutex);
+                    if (--remaining == 0) done.notify_all();
+                });
+        }
+
+        // Help with queued work, then wait for chunks still running.
+        while (remaining > 0 && runOne(next_queue++ % queues.size()))
+        {
+        }
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done.wait(lock, [&] { return remaining == 0; });
+    }
+
+   private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<Queue> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next_queue{0};
+    std::atomic<size_t> pending{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void push(std::function<void()> task)
+    {
+        // Counted before it is queued, so that whoever runs it cannot
+        // decrement pending below zero.
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            ++pending;
+        }
+        Queue &queue = queues[next_queue++ % queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+    // Runs one task, from queue home if it has any, else stolen from another.
+    bool runOne(size_t home)
+    {
+        std::function<void()> task;
+        for (size_t i = 0; i < queues.size() && !task; ++i)
+        {
+            Queue &queue = queues[(home + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+            if (i == 0)
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            }
+            else
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+        }
+        if (!task) return false;
+
+        --pending;
+        task();
+        return true;
+    }
+    void workerLoop(size_t home)
+    {
+        while (true)
+        {
+            if (runOne(home)) continue;
+
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this] { return stopping || pending > 0; });
+            if (stopping && pending == 0) return;
+        }
+    }
+};
+
+// Pool shared by the parallel operations when none is given.
+ThreadPool &defaultThreadPool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
 class Serializeable
 {
    public:
     Serializeable() {}
     virtual ~Serializeable() {};
-    virtual std::string toString(Layout const &layout) const = 0;
+    virtual void serialize(Writer &writer, Layout const &layout) const = 0;
+    std::string toString(Layout const &layout = Layout()) const
+    {
+        Writer writer;
+        serialize(writer, layout);
+        return writer.take();
+    }
+};
+
+namespace detail
+{
+// Decimal text of every byte value, so colors are written by copying.
+struct ByteText
+{
+    char chars[3];
+    unsigned char size;
 };
+inline constexpr std::array<ByteText, 256> byte_texts = []
+{
+    std::array<ByteText, 256> table{};
+    for (int value = 0; value < 256; ++value)
+    {
+        ByteText &text = table[value];
+        if (value >= 100) text.chars[text.size++] = char('0' + value / 100);
+        if (value >= 10) text.chars[text.size++] = char('0' + value / 10 % 10);
+        text.chars[text.size++] = char('0' + value % 10);
+    }
+    return table;
+}();
+inline constexpr char hex_digits[] = "0123456789abcdef";
+}  // namespace detail
 
 class Color : public Serializeable
 {
@@ -159,86 +792,110 @@ class Color : public Serializeable
         Yellow
     };
 
-    Color(int r, int g, int b) : transparent(false), red(r), green(g), blue(b)
+    // Channels are clamped to [0, 255] and alpha to [0, 1].
+    Color(int r, int g, int b, double alpha = 1)
+        : transparent(false),
+          red(channel(r)),
+          green(channel(g)),
+          blue(channel(b)),
+          alpha(std::clamp(alpha, 0.0, 1.0))
     {
     }
     explicit Color(Defaults color)
-        : transparent(false), red(0), green(0), blue(0)
+        : transparent(color < Aqua || color > Yellow),
+          red(transparent ? 0 : named[color][0]),
+          green(transparent ? 0 : named[color][1]),
+          blue(transparent ? 0 : named[color][2])
     {
-        switch (color)
-        {
-            case Aqua:
-                assign(0, 255, 255);
-                break;
-            case Black:
-                assign(0, 0, 0);
-                break;
-            case Blue:
-                assign(0, 0, 255);
-                break;
-            case Brown:
-                assign(165, 42, 42);
-                break;
-            case Cyan:
-                assign(0, 255, 255);
-                break;
-            case Fuchsia:
-                assign(255, 0, 255);
-                break;
-            case Green:
-                assign(0, 128, 0);
-                break;
-            case Lime:
-                assign(0, 255, 0);
-                break;
-            case Magenta:
-                assign(255, 0, 255);
-                break;
-            case Orange:
-                assign(255, 165, 0);
-                break;
-            case Purple:
-                assign(128, 0, 128);
-                break;
-            case Red:
-                assign(255, 0, 0);
-                break;
-            case Silver:
-                assign(192, 192, 192);
-                break;
-            case White:
-                assign(255, 255, 255);
-                break;
-            case Yellow:
-                assign(255, 255, 0);
-                break;
-            default:
-                transparent = true;
-                break;
-        }
     }
     virtual ~Color() override {}
-    std::string toString(Layout const &layout = Layout()) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
         if (transparent)
-            ss << "transparent";
-        else
-            ss << "rgb(" << red << "," << green << "," << blue << ")";
-        return ss.str();
+        {
+            writer << "transparent";
+            return;
+        }
+
+        char chars[24];
+        if (writer.getColorFormat() == ColorFormat::Hex)
+        {
+            writer << std::string_view(chars, serializeHex(chars) - chars);
+            return;
+        }
+        char *out = copy(chars, alpha < 1 ? "rgba(" : "rgb(");
+        out = copy(out, red) + 1;
+        out[-1] = ',';
+        out = copy(out, green) + 1;
+        out[-1] = ',';
+        out = copy(out, blue);
+        if (alpha < 1)
+        {
+            // Opacity keeps 3 decimals whatever the coordinate precision.
+            *out++ = ',';
+            out = std::to_chars(out, chars + sizeof chars, alpha,
+                                std::chars_format::fixed, 3)
+                      .ptr;
+            while (out[-1] == '0') --out;
+            if (out[-1] == '.') --out;
+        }
+        writer << std::string_view(chars, copy(out, ")") - chars);
+    }
+
+    // Same color with another opacity.
+    Color withAlpha(double new_alpha) const
+    {
+        Color color = *this;
+        color.alpha = std::clamp(new_alpha, 0.0, 1.0);
+        return color;
     }
 
    private:
+    // Channels of the Defaults, from Aqua to Yellow.
+    static constexpr unsigned char named[][3] = {
+        {0, 255, 255},   {0, 0, 0},     {0, 0, 255},     {165, 42, 42},
+        {0, 255, 255},   {255, 0, 255}, {0, 128, 0},     {0, 255, 0},
+        {255, 0, 255},   {255, 165, 0}, {128, 0, 128},   {255, 0, 0},
+        {192, 192, 192}, {255, 255, 255}, {255, 255, 0}};
+
     bool transparent;
-    int red;
-    int green;
-    int blue;
+    unsigned char red;
+    unsigned char green;
+    unsigned char blue;
+    double alpha = 1;
 
-    void assign(int r, int g, int b)
+    static unsigned char channel(int value)
+    {
+        return static_cast<unsigned char>(std::clamp(value, 0, 255));
+    }
+    static char *copy(char *out, std::string_view text)
+    {
+        return std::copy(text.begin(), text.end(), out);
+    }
+    static char *copy(char *out, unsigned char value)
+    {
+        detail::ByteText const &text = detail::byte_texts[value];
+        return std::copy(text.chars, text.chars + text.size, out);
+    }
+    // Writes #rgb or #rrggbb, with a fourth channel for alpha below 1, to
+    // out and returns the end.
+    char *serializeHex(char *out) const
     {
-        red = r;
-        green = g;
-        blue = b;
+        unsigned char channels[4] = {
+            red, green, blue,
+            static_cast<unsigned char>(std::lround(alpha * 255))};
+        const int count = alpha < 1 ? 4 : 3;
+        bool short_form = true;
+        for (int i = 0; i < count; ++i)
+            short_form = short_form && channels[i] >> 4 == (channels[i] & 15);
+
+        *out++ = '#';
+        for (int i = 0; i < count; ++i)
+        {
+            *out++ = detail::hex_digits[channels[i] >> 4];
+            if (!short_form) *out++ = detail::hex_digits[channels[i] & 15];
+        }
+        return out;
     }
 };
 
@@ -250,11 +907,19 @@ class Fill : public Serializeable
     {
     }
     explicit Fill(Color color) : color(color) {}
-    std::string toString(Layout const &layout = Layout()) const override
+    Color const &getColor() const { return color; }
+    void serialize(Writer &writer, Layout const &layout) const override
+    {
+        writer << "fill=\"";
+        color.serialize(writer, layout);
+        writer << "\" ";
+    }
+    // The same as a CSS declaration.
+    void serializeCss(Writer &writer, Layout const &layout) const
     {
-        std::stringstream ss;
-        ss << attribute("fill", color.toString());
-        return ss.str();
+        writer << "fill:";
+        color.serialize(writer, layout);
+        writer << ';';
     }
 
    private:
@@ -269,15 +934,29 @@ class Stroke : public Serializeable
     {
     }
     explicit Stroke(double width, Color color) : width(width), color(color) {}
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
         // If stroke width is invalid.
-        if (width <= 0) return std::string();
+        if (width <= 0) return;
 
-        std::stringstream ss;
-        ss << attribute("stroke-width", translateScale(width, layout))
-           << attribute("stroke", color.toString());
-        return ss.str();
+        writer.attribute("stroke-width", translateScale(width, layout))
+            << "stroke=\"";
+        color.serialize(writer, layout);
+        writer << "\" ";
+    }
+    void serializeCss(Writer &writer, Layout const &layout) const
+    {
+        if (width <= 0) return;
+
+        writer << "stroke-width:" << translateScale(width, layout)
+               << ";stroke:";
+        color.serialize(writer, layout);
+        writer << ';';
+    }
+    // How far the stroke reaches beyond the outline it follows.
+    double extent(Layout const &layout) const
+    {
+        return width > 0 ? translateScale(width, layout) / 2 : 0;
     }
 
    private:
@@ -292,12 +971,20 @@ class Font : public Serializeable
         : size(size), family(family)
     {
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
+    {
+        writer.attribute("font-size", translateScale(size, layout))
+            .attribute("font-family", family);
+    }
+    // CSS font sizes need a unit, unlike the attribute.
+    void serializeCss(Writer &writer, Layout const &layout) const
+    {
+        writer << "font-size:" << translateScale(size, layout)
+               << "px;font-family:" << family << ';';
+    }
+    double height(Layout const &layout) const
     {
-        std::stringstream ss;
-        ss << attribute("font-size", translateScale(size, layout))
-           << attribute("font-family", family);
-        return ss.str();
+        return translateScale(size, layout);
     }
 
    private:
@@ -305,30 +992,433 @@ class Font : public Serializeable
     std::string family;
 };
 
-class Shape : public Serializeable
+// Interns the distinct styles of a document as CSS classes, named in the
+// order they are first seen.  Not thread-safe; serializeParallel() falls
+// back to serializing in order when the writer has a style sheet.
+class StyleSheet
 {
    public:
-    Shape(Fill const &fill = Fill(), Stroke const &stroke = Stroke())
-        : fill(fill), stroke(stroke)
+    // Class name for the CSS declarations, adding a rule if they are new.
+    std::string_view intern(std::string_view declarations)
     {
+        auto found = classes.find(declarations);
+        if (found == classes.end())
+        {
+            std::string name = "s";
+            for (size_t n = classes.size();; n /= 36)
+            {
+                name += "0123456789abcdefghijklmnopqrstuvwxyz"[n % 36];
+                if (n < 36) break;
+            }
+            rules << "\t\t." << name << '{' << declarations << "}\n";
+            found = classes.emplace(declarations, std::move(name)).first;
+        }
+        return found->second;
+    }
+    // Scratch buffer for formatting declarations before interning them.
+    Writer &scratch() { return declarations; }
+
+    // The <style> element, or nothing if no style was interned.
+    void serialize(Writer &writer) const
+    {
+        if (classes.empty()) return;
+
+        writer << "\t<style type=\"text/css\">\n" << rules.str()
+               << "\t</style>\n";
+    }
+    size_t size() const { return classes.size(); }
+
+   private:
+    struct Hash
+    {
+        using is_transparent = void;
+        size_t operator()(std::string_view text) const
+        {
+            return std::hash<std::string_view>()(text);
+        }
+    };
+    std::unordered_map<std::string, std::string, Hash, std::equal_to<>>
+        classes;
+    Writer rules;
+    Writer declarations;
+};
+
+// Writes the style parts (Fill, Stroke, Font) as attributes, or, if the
+// writer has a style sheet, as a class attribute naming them.
+template <typename... Parts>
+void serializeStyle(Writer &writer, Layout const &layout,
+                    Parts const &...parts)
+{
+    StyleSheet *sheet = writer.getStyleSheet();
+    if (!sheet)
+    {
+        (parts.serialize(writer, layout), ...);
+        return;
+    }
+
+    Writer &declarations = sheet->scratch();
+    declarations.clear();
+    declarations.setFormat(writer);
+    (parts.serializeCss(declarations, layout), ...);
+    if (declarations.empty()) return;
+    writer.attribute("class", sheet->intern(declarations.str()));
+}
+
+class Shape : public Serializeable
+{
+   public:
+    Shape(Fill const &fill = Fill(), Stroke const &stroke = Stroke())
+        : fill(fill), stroke(stroke)
+    {
+    }
+    Shape(Shape const &other) = default;
+    // Counts as a mutation of this shape; see revision().
+    Shape &operator=(Shape const &other)
+    {
+        fill = other.fill;
+        stroke = other.stroke;
+        touch();
+        return *this;
     }
     virtual ~Shape() override {}
-    virtual std::string toString(Layout const &layout) const override = 0;
     virtual void offset(Point const &offset) = 0;
     virtual std::unique_ptr<Shape> clone() const = 0;
+    // Copy allocated, along with the storage it owns, from resource.  Shapes
+    // that do not override this are copied to the heap.
+    virtual std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const
+    {
+        return clone();
+    }
+    // Area the shape covers when serialized with layout, including its
+    // stroke, or nullopt if unknown.  Shapes with unknown bounds are never
+    // culled.
+    virtual std::optional<Box> bounds(Layout const &layout) const
+    {
+        return std::nullopt;
+    }
+    // Changes whenever the shape is mutated through its interface (offset,
+    // insertion, setters, assignment), so a cache of its serialized text
+    // can tell when it is stale.
+    size_t revision() const { return revision_count; }
 
    protected:
     Fill fill;
     Stroke stroke;
+
+    void touch() { ++revision_count; }
+
+   private:
+    size_t revision_count = 0;
 };
+// Implements Shape::cloneInto.  Shapes with an allocator_type get the
+// allocator passed on to their copy constructor.
+template <typename T>
+std::shared_ptr<Shape> allocateShape(T const &shape,
+                                     std::pmr::memory_resource *resource)
+{
+    return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(resource),
+                                   shape);
+}
+
 template <typename T>
-std::string vectorToString(std::vector<T> collection, Layout const &layout)
+std::string vectorToString(std::vector<T> const &collection,
+                           Layout const &layout)
 {
-    std::string combination_str;
+    Writer writer;
     for (unsigned i = 0; i < collection.size(); ++i)
-        combination_str += collection[i].toString(layout);
+        collection[i].serialize(writer, layout);
+
+    return writer.take();
+}
+
+// Writes the "x,y x,y ... " list of a points attribute.  Points are converted
+// to SVG space a block at a time into a stack buffer, then formatted.
+void serializePoints(Writer &writer, std::span<const Point> points,
+                     Layout const &layout)
+{
+    const size_t block_size = 256;
+    double coordinates[2 * block_size];
+    for (size_t first = 0; first < points.size(); first += block_size)
+    {
+        size_t count = std::min(block_size, points.size() - first);
+        translatePoints(points.data() + first, count, layout, coordinates);
+        for (size_t i = 0; i < 2 * count; i += 2)
+            writer << coordinates[i] << ',' << coordinates[i + 1] << ' ';
+    }
+}
+
+// How Polyline, Polygon and LineChart write their points.
+enum class PointEncoding
+{
+    // points="x,y x,y ..." on a <polyline> or <polygon>.
+    Points,
+    // Compact relative path data on a <path>.
+    Path
+};
+
+// Writes the d attribute text of a path through points: an absolute M, then
+// relative l, h and v commands with implicit repetition and no separator
+// before a minus sign.  Each step is measured from where the previous,
+// rounded, steps put the pen, so rounding errors do not add up.
+void serializePathData(Writer &writer, std::span<const Point> points,
+                       Layout const &layout, bool closed)
+{
+    if (points.empty()) return;
+
+    char command = 0;
+    // Whether the last thing written was a number that a following ".5"
+    // would continue.
+    bool after_number = false;
+    bool after_decimal = false;
+    auto writeCommand = [&](char next)
+    {
+        if (next == command) return;
+        writer << next;
+        command = next;
+        after_number = false;
+    };
+    auto writeNumber = [&](char const *first, char const *last)
+    {
+        if (after_number &&
+            !(first[0] == '-' || (first[0] == '.' && after_decimal)))
+            writer << ' ';
+        writer << std::string_view(first, last - first);
+        after_number = true;
+        after_decimal = std::find(first, last, '.') != last &&
+                        std::find(first, last, 'e') == last;
+    };
+
+    char x_text[Writer::max_number_size];
+    char y_text[Writer::max_number_size];
+    Point pen;
+    auto format = [&](char *text, double value, double &rounded)
+    {
+        char *last = writer.formatNumber(text, value);
+        std::from_chars(text, last, rounded);
+        return last;
+    };
+
+    const size_t block_size = 256;
+    double coordinates[2 * block_size];
+    for (size_t first = 0; first < points.size(); first += block_size)
+    {
+        size_t count = std::min(block_size, points.size() - first);
+        translatePoints(points.data() + first, count, layout, coordinates);
+        for (size_t i = 0; i < 2 * count; i += 2)
+        {
+            double x = coordinates[i];
+            double y = coordinates[i + 1];
+            if (first + i == 0)
+            {
+                writeCommand('M');
+                writeNumber(x_text, format(x_text, x, pen.x));
+                writeNumber(y_text, format(y_text, y, pen.y));
+                continue;
+            }
+
+            Point step;
+            char *x_last = format(x_text, x - pen.x, step.x);
+            char *y_last = format(y_text, y - pen.y, step.y);
+            if (step.x == 0 && step.y == 0) continue;
+
+            if (step.y == 0)
+            {
+                writeCommand('h');
+                writeNumber(x_text, x_last);
+            }
+            else if (step.x == 0)
+            {
+                writeCommand('v');
+                writeNumber(y_text, y_last);
+            }
+            else
+            {
+                writeCommand('l');
+                writeNumber(x_text, x_last);
+                writeNumber(y_text, y_last);
+            }
+            pen.x += step.x;
+            pen.y += step.y;
+        }
+    }
+    if (closed) writer << 'z';
+}
 
-    return combination_str;
+// False only for shapes known to lie entirely outside the layout's canvas.
+bool isVisible(Shape const &shape, Layout const &layout)
+{
+    std::optional<Box> box = shape.bounds(layout);
+    return !box || box->intersects(canvasBox(layout));
+}
+
+namespace detail
+{
+template <typename T>
+struct IsVariant : std::false_type
+{
+};
+template <typename... Types>
+struct IsVariant<std::variant<Types...>> : std::true_type
+{
+};
+
+template <typename T>
+Shape const &asShape(T const &shape)
+{
+    if constexpr (std::is_base_of_v<Shape, T>)
+        return shape;
+    else if constexpr (IsVariant<T>::value)
+        return std::visit([](auto const &item) -> Shape const &
+                          { return item; },
+                          shape);
+    else
+        return *shape;
+}
+
+// Serializes a shape, a pointer to one or a variant of shapes.  Variants
+// call their alternative's serialize() directly, without virtual dispatch.
+template <typename T>
+void serializeShape(T const &shape, Writer &writer, Layout const &layout)
+{
+    if constexpr (IsVariant<T>::value)
+        std::visit(
+            [&](auto const &item)
+            {
+                using Item = std::decay_t<decltype(item)>;
+                item.Item::serialize(writer, layout);
+            },
+            shape);
+    else
+        asShape(shape).serialize(writer, layout);
+}
+}  // namespace detail
+
+// Serializes a vector of shapes (or of pointers to shapes, or of variants of
+// shapes) into writer, each preceded by prefix.  Chunks of shapes are
+// serialized on the pool into separate buffers that are then appended in
+// order, so the output is the same as serializing them one by one.  With
+// cull, shapes outside the layout's canvas are skipped.  Styles are
+// interned in order, so a writer with a style sheet is written sequentially.
+template <typename T, typename Allocator>
+void serializeParallel(Writer &writer, std::vector<T, Allocator> const &shapes,
+                       Layout const &layout, ThreadPool &pool,
+                       std::string_view prefix = "", bool cull = false)
+{
+    // Below this many shapes per chunk, threading costs more than it saves.
+    const size_t min_chunk_size = 64;
+    const size_t chunk_count = std::min(4 * pool.size(),
+                                        shapes.size() / min_chunk_size);
+    if (chunk_count < 2 || writer.getStyleSheet())
+    {
+        for (auto const &shape : shapes)
+        {
+            if (!cull || isVisible(detail::asShape(shape), layout))
+                detail::serializeShape(shape, writer << prefix, layout);
+        }
+        return;
+    }
+
+    const size_t chunk_size = (shapes.size() + chunk_count - 1) / chunk_count;
+    std::vector<Writer> chunks(chunk_count);
+    for (Writer &chunk : chunks) chunk.setFormat(writer);
+    pool.parallelFor(
+        chunk_count,
+        [&](size_t chunk)
+        {
+            size_t first = chunk * chunk_size;
+            size_t last = std::min(shapes.size(), first + chunk_size);
+            for (size_t i = first; i < last; ++i)
+            {
+                if (!cull || isVisible(detail::asShape(shapes[i]), layout))
+                    detail::serializeShape(shapes[i], chunks[chunk] << prefix,
+                                           layout);
+            }
+        });
+    for (Writer const &chunk : chunks) writer << chunk.str();
+}
+
+// Visvalingam-Whyatt simplification.  Repeatedly drops the point whose
+// triangle with its two neighbours has the smallest area, until every
+// remaining triangle covers at least min_area.  Open lines keep their end
+// points, closed rings keep at least three points.  O(n log n).
+std::vector<Point> simplifyVisvalingam(std::span<const Point> points,
+                                       double min_area, bool closed = false)
+{
+    const size_t count = points.size();
+    const size_t min_count = closed ? 3 : 2;
+    if (count <= min_count)
+        return std::vector<Point>(points.begin(), points.end());
+
+    std::vector<size_t> prev(count), next(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        prev[i] = (i + count - 1) % count;
+        next[i] = (i + 1) % count;
+    }
+    auto triangleArea = [&](size_t i)
+    {
+        Point const &a = points[prev[i]];
+        Point const &b = points[i];
+        Point const &c = points[next[i]];
+        return std::abs((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y)) /
+               2;
+    };
+
+    // Min-heap of (area, index); entries whose area is out of date are
+    // skipped when popped.
+    using Entry = std::pair<double, size_t>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    std::vector<double> area(count);
+    std::vector<bool> removed(count, false);
+    for (size_t i = closed ? 0 : 1; i < (closed ? count : count - 1); ++i)
+    {
+        area[i] = triangleArea(i);
+        heap.push(Entry(area[i], i));
+    }
+
+    size_t remaining = count;
+    while (remaining > min_count && !heap.empty())
+    {
+        auto [smallest, i] = heap.top();
+        heap.pop();
+        if (removed[i] || smallest != area[i]) continue;
+        if (smallest >= min_area) break;
+
+        removed[i] = true;
+        --remaining;
+        next[prev[i]] = next[i];
+        prev[next[i]] = prev[i];
+        // A neighbour's area never drops below that of the point removed
+        // before it, which keeps the elimination order stable.
+        for (size_t neighbour : {prev[i], next[i]})
+        {
+            if (!closed && (neighbour == 0 || neighbour == count - 1))
+                continue;
+            area[neighbour] = std::max(triangleArea(neighbour), smallest);
+            heap.push(Entry(area[neighbour], neighbour));
+        }
+    }
+
+    std::vector<Point> simplified;
+    simplified.reserve(remaining);
+    for (size_t i = 0; i < count; ++i)
+        if (!removed[i]) simplified.push_back(points[i]);
+    return simplified;
+}
+// Area threshold for simplifyVisvalingam() given a tolerance in output
+// pixels: triangles smaller than a tolerance-sized square are dropped.
+double simplifyArea(double tolerance, Layout const &layout)
+{
+    double user_tolerance = tolerance / layout.scale;
+    return user_tolerance * user_tolerance;
+}
+
+// Stroke extent of a path including mitered joins, which reach up to the
+// default miter limit of 4 times the half stroke width.
+double joinExtent(Stroke const &stroke, Layout const &layout)
+{
+    return 4 * stroke.extent(layout);
 }
 
 class Circle : public Shape
@@ -339,19 +1429,18 @@ class Circle : public Shape
         : Shape(fill, stroke), center(center), radius(diameter / 2)
     {
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("circle")
-           << attribute("cx", translateX(center.x, layout))
-           << attribute("cy", translateY(center.y, layout))
-           << attribute("r", translateScale(radius, layout))
-           << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        writer.elemStart("circle")
+            .attribute("cx", translateX(center.x, layout))
+            .attribute("cy", translateY(center.y, layout))
+            .attribute("r", translateScale(radius, layout));
+        serializeStyle(writer, layout, fill, stroke);
+        writer.emptyElemEnd();
     }
     void offset(Point const &offset) override
     {
+        touch();
         center.x += offset.x;
         center.y += offset.y;
     }
@@ -360,6 +1449,16 @@ class Circle : public Shape
     {
         return std::make_unique<Circle>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        return translateBox(center, center, layout)
+            .expand(translateScale(radius, layout) + stroke.extent(layout));
+    }
 
    private:
     Point center;
@@ -377,20 +1476,19 @@ class Elipse : public Shape
           radius_height(height / 2)
     {
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("ellipse")
-           << attribute("cx", translateX(center.x, layout))
-           << attribute("cy", translateY(center.y, layout))
-           << attribute("rx", translateScale(radius_width, layout))
-           << attribute("ry", translateScale(radius_height, layout))
-           << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        writer.elemStart("ellipse")
+            .attribute("cx", translateX(center.x, layout))
+            .attribute("cy", translateY(center.y, layout))
+            .attribute("rx", translateScale(radius_width, layout))
+            .attribute("ry", translateScale(radius_height, layout));
+        serializeStyle(writer, layout, fill, stroke);
+        writer.emptyElemEnd();
     }
     void offset(Point const &offset) override
     {
+        touch();
         center.x += offset.x;
         center.y += offset.y;
     }
@@ -399,6 +1497,19 @@ class Elipse : public Shape
     {
         return std::make_unique<Elipse>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        Point radius(radius_width, radius_height);
+        return translateBox(Point(center.x - radius.x, center.y - radius.y),
+                            Point(center.x + radius.x, center.y + radius.y),
+                            layout)
+            .expand(stroke.extent(layout));
+    }
 
    private:
     Point center;
@@ -414,19 +1525,19 @@ class Rectangle : public Shape
         : Shape(fill, stroke), edge(edge), width(width), height(height)
     {
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("rect") << attribute("x", translateX(edge.x, layout))
-           << attribute("y", translateY(edge.y, layout) - height)
-           << attribute("width", translateScale(width, layout))
-           << attribute("height", translateScale(height, layout))
-           << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        writer.elemStart("rect")
+            .attribute("x", translateX(edge.x, layout))
+            .attribute("y", translateY(edge.y, layout) - height)
+            .attribute("width", translateScale(width, layout))
+            .attribute("height", translateScale(height, layout));
+        serializeStyle(writer, layout, fill, stroke);
+        writer.emptyElemEnd();
     }
     void offset(Point const &offset) override
     {
+        touch();
         edge.x += offset.x;
         edge.y += offset.y;
     }
@@ -435,6 +1546,21 @@ class Rectangle : public Shape
     {
         return std::make_unique<Rectangle>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        // Mirrors serialize(), which offsets y by the unscaled height.
+        Point corner(translateX(edge.x, layout),
+                     translateY(edge.y, layout) - height);
+        return Box::spanning(corner,
+                             Point(corner.x + translateScale(width, layout),
+                                   corner.y + translateScale(height, layout)))
+            .expand(stroke.extent(layout));
+    }
 
    private:
     Point edge;
@@ -450,19 +1576,19 @@ class Line : public Shape
         : Shape(Fill(), stroke), start_point(start_point), end_point(end_point)
     {
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("line")
-           << attribute("x1", translateX(start_point.x, layout))
-           << attribute("y1", translateY(start_point.y, layout))
-           << attribute("x2", translateX(end_point.x, layout))
-           << attribute("y2", translateY(end_point.y, layout))
-           << stroke.toString(layout) << emptyElemEnd();
-        return ss.str();
+        writer.elemStart("line")
+            .attribute("x1", translateX(start_point.x, layout))
+            .attribute("y1", translateY(start_point.y, layout))
+            .attribute("x2", translateX(end_point.x, layout))
+            .attribute("y2", translateY(end_point.y, layout));
+        serializeStyle(writer, layout, stroke);
+        writer.emptyElemEnd();
     }
     void offset(Point const &offset) override
     {
+        touch();
         start_point.x += offset.x;
         start_point.y += offset.y;
 
@@ -474,6 +1600,16 @@ class Line : public Shape
     {
         return std::make_unique<Line>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        return translateBox(start_point, end_point, layout)
+            .expand(stroke.extent(layout));
+    }
 
    private:
     Point start_point;
@@ -491,28 +1627,39 @@ class Polygon : public Shape
         : Shape(Fill(Color::Transparent), stroke)
     {
     }
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    Polygon(Polygon const &other, allocator_type allocator)
+        : Shape(other),
+          points(other.points, allocator),
+          encoding(other.encoding)
+    {
+    }
     Polygon &operator<<(Point const &point)
     {
+        touch();
         points.push_back(point);
         return *this;
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("polygon");
-
-        ss << "points=\"";
-        for (unsigned i = 0; i < points.size(); ++i)
-            ss << translateX(points[i].x, layout) << ","
-               << translateY(points[i].y, layout) << " ";
-        ss << "\" ";
+        if (encoding == PointEncoding::Path)
+        {
+            writer.elemStart("path") << "d=\"";
+            serializePathData(writer, points, layout, true);
+        }
+        else
+        {
+            writer.elemStart("polygon") << "points=\"";
+            serializePoints(writer, points, layout);
+        }
+        writer << "\" ";
 
-        ss << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        serializeStyle(writer, layout, fill, stroke);
+        writer.emptyElemEnd();
     }
     void offset(Point const &offset) override
     {
+        touch();
         for (unsigned i = 0; i < points.size(); ++i)
         {
             points[i].x += offset.x;
@@ -524,9 +1671,37 @@ class Polygon : public Shape
     {
         return std::make_unique<Polygon>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        if (points.empty()) return std::nullopt;
+        return translateBox(*getMinPoint(points), *getMaxPoint(points), layout)
+            .expand(joinExtent(stroke, layout));
+    }
+
+    // Drops points that make no visible difference at the given tolerance
+    // in output pixels; see simplifyVisvalingam().
+    void simplify(double tolerance, Layout const &layout)
+    {
+        std::vector<Point> simplified = simplifyVisvalingam(
+            points, simplifyArea(tolerance, layout), true);
+        points.assign(simplified.begin(), simplified.end());
+        touch();
+    }
+
+    void setEncoding(PointEncoding new_encoding)
+    {
+        encoding = new_encoding;
+        touch();
+    }
 
    private:
-    std::vector<Point> points;
+    std::pmr::vector<Point> points;
+    PointEncoding encoding = PointEncoding::Points;
 };
 
 class Polyline : public Shape
@@ -541,49 +1716,309 @@ class Polyline : public Shape
         : Shape(Fill(Color::Transparent), stroke)
     {
     }
+    explicit Polyline(std::span<const Point> points,
+                      Fill const &fill = Fill(),
+                      Stroke const &stroke = Stroke())
+        : Shape(fill, stroke), points(points.begin(), points.end())
+    {
+        updateBounds();
+    }
     explicit Polyline(std::vector<Point> const &points,
                       Fill const &fill = Fill(),
                       Stroke const &stroke = Stroke())
-        : Shape(fill, stroke), points(points)
+        : Polyline(std::span<const Point>(points), fill, stroke)
+    {
+    }
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    Polyline(Polyline const &other, allocator_type allocator)
+        : Shape(other),
+          points(other.points, allocator),
+          encoding(other.encoding),
+          min_point(other.min_point),
+          max_point(other.max_point)
     {
     }
     Polyline &operator<<(Point const &point)
     {
+        touch();
         points.push_back(point);
+        if (points.size() == 1)
+        {
+            min_point = max_point = point;
+            return *this;
+        }
+        if (point.x < min_point.x) min_point.x = point.x;
+        if (point.y < min_point.y) min_point.y = point.y;
+        if (point.x > max_point.x) max_point.x = point.x;
+        if (point.y > max_point.y) max_point.y = point.y;
         return *this;
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("polyline");
-
-        ss << "points=\"";
-        for (unsigned i = 0; i < points.size(); ++i)
-            ss << translateX(points[i].x, layout) << ","
-               << translateY(points[i].y, layout) << " ";
-        ss << "\" ";
+        if (encoding == PointEncoding::Path)
+        {
+            writer.elemStart("path") << "d=\"";
+            serializePathData(writer, points, layout, false);
+        }
+        else
+        {
+            writer.elemStart("polyline") << "points=\"";
+            serializePoints(writer, points, layout);
+        }
+        writer << "\" ";
 
-        ss << fill.toString(layout) << stroke.toString(layout)
-           << emptyElemEnd();
-        return ss.str();
+        serializeStyle(writer, layout, fill, stroke);
+        writer.emptyElemEnd();
     }
     void offset(Point const &offset) override
     {
+        touch();
         for (unsigned i = 0; i < points.size(); ++i)
         {
             points[i].x += offset.x;
             points[i].y += offset.y;
         }
+        min_point.x += offset.x;
+        min_point.y += offset.y;
+        max_point.x += offset.x;
+        max_point.y += offset.y;
     }
 
     virtual std::unique_ptr<Shape> clone() const override
     {
         return std::make_unique<Polyline>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        // From the points rather than the cached bounds, which are stale
+        // if points were modified directly.
+        if (points.empty()) return std::nullopt;
+        return translateBox(*getMinPoint(points), *getMaxPoint(points), layout)
+            .expand(joinExtent(stroke, layout));
+    }
+
+    // Bounds of the points, maintained by operator<< and offset().
+    // Call updateBounds() after modifying points directly; it also counts
+    // as a mutation for revision().
+    std::optional<Point> minPoint() const
+    {
+        if (points.empty()) return std::nullopt;
+        return min_point;
+    }
+    std::optional<Point> maxPoint() const
+    {
+        if (points.empty()) return std::nullopt;
+        return max_point;
+    }
+    void updateBounds()
+    {
+        touch();
+        min_point = getMinPoint(points).value_or(Point());
+        max_point = getMaxPoint(points).value_or(Point());
+    }
+
+    // Drops points that make no visible difference at the given tolerance
+    // in output pixels; see simplifyVisvalingam().
+    void simplify(double tolerance, Layout const &layout)
+    {
+        std::vector<Point> simplified =
+            simplifyVisvalingam(points, simplifyArea(tolerance, layout));
+        points.assign(simplified.begin(), simplified.end());
+        updateBounds();
+    }
+
+    // Polyline with the same fill and stroke but other points.
+    Polyline withPoints(std::span<const Point> other_points) const
+    {
+        Polyline polyline(other_points, fill, stroke);
+        polyline.encoding = encoding;
+        return polyline;
+    }
+
+    void setEncoding(PointEncoding new_encoding)
+    {
+        encoding = new_encoding;
+        touch();
+    }
+
+    // Allocated from the resource the polyline was cloned into.  Not a
+    // std::vector; copy it with std::vector<Point>(begin(), end()).
+    std::pmr::vector<Point> points;
+
+   private:
+    PointEncoding encoding = PointEncoding::Points;
+    Point min_point;
+    Point max_point;
+};
+
+// Largest-Triangle-Three-Buckets downsampling of a series ordered by x.
+// Keeps the first and last point and, from each of threshold - 2 equal
+// buckets in between, the point forming the largest triangle with the point
+// kept before it and the average of the next bucket.
+std::vector<Point> downsampleLTTB(std::span<const Point> points,
+                                  size_t threshold)
+{
+    if (threshold < 3 || threshold >= points.size())
+        return std::vector<Point>(points.begin(), points.end());
+
+    std::vector<Point> sampled;
+    sampled.reserve(threshold);
+    sampled.push_back(points.front());
+
+    const size_t count = points.size();
+    const double bucket_size = double(count - 2) / (threshold - 2);
+    size_t kept = 0;
+    for (size_t bucket = 0; bucket < threshold - 2; ++bucket)
+    {
+        size_t next_first = size_t((bucket + 1) * bucket_size) + 1;
+        size_t next_last =
+            std::min(size_t((bucket + 2) * bucket_size) + 1, count);
+        Point average;
+        for (size_t i = next_first; i < next_last; ++i)
+        {
+            average.x += points[i].x;
+            average.y += points[i].y;
+        }
+        average.x /= next_last - next_first;
+        average.y /= next_last - next_first;
+
+        size_t first = size_t(bucket * bucket_size) + 1;
+        size_t last = next_first;
+        Point const &a = points[kept];
+        double max_area = -1;
+        for (size_t i = first; i < last; ++i)
+        {
+            // Twice the triangle area; only the ordering matters.
+            double area = std::abs((a.x - average.x) * (points[i].y - a.y) -
+                                   (a.x - points[i].x) * (average.y - a.y));
+            if (area > max_area)
+            {
+                max_area = area;
+                kept = i;
+            }
+        }
+        sampled.push_back(points[kept]);
+    }
+
+    sampled.push_back(points.back());
+    return sampled;
+}
+
+// Level-of-detail pyramid over a series ordered by x.  Level k holds, for
+// each bucket of 2^k consecutive points, the indices of its lowest and
+// highest point, so a view of any x-range at any width is read from the
+// level whose buckets are about a pixel wide in O(log n + output) time,
+// keeping every peak.  Stores indices only; queries take the points the
+// pyramid was built from, which may since have been offset but not
+// otherwise changed.
+class PolylinePyramid
+{
+   public:
+    explicit PolylinePyramid(std::span<const Point> points)
+    {
+        if (points.size() < 2) return;
+
+        std::vector<Envelope> level((points.size() + 1) / 2);
+        for (size_t i = 0; i < level.size(); ++i)
+        {
+            size_t a = 2 * i, b = std::min(a + 1, points.size() - 1);
+            bool lower = points[a].y <= points[b].y;
+            level[i] = Envelope{lower ? a : b, lower ? b : a};
+        }
+        levels.push_back(std::move(level));
+        while (levels.back().size() > 1)
+        {
+            std::vector<Envelope> const &below = levels.back();
+            std::vector<Envelope> above((below.size() + 1) / 2);
+            for (size_t i = 0; i < above.size(); ++i)
+            {
+                Envelope const &a = below[2 * i];
+                Envelope const &b = below[std::min(2 * i + 1,
+                                                   below.size() - 1)];
+                above[i].min = points[b.min].y < points[a.min].y ? b.min
+                                                                 : a.min;
+                above[i].max = points[b.max].y > points[a.max].y ? b.max
+                                                                 : a.max;
+            }
+            levels.push_back(std::move(above));
+        }
+    }
+
+    // Points of the view between x_min and x_max that is buckets wide:
+    // the first and last point plus the lowest and highest point of each
+    // of about buckets equal runs, in order.  One point beyond each end of
+    // the range is included so the line reaches the edges of the view.
+    std::vector<Point> view(std::span<const Point> points, double x_min,
+                            double x_max, size_t buckets) const
+    {
+        size_t first =
+            std::lower_bound(points.begin(), points.end(), x_min,
+                             [](Point const &point, double x)
+                             { return point.x < x; }) -
+            points.begin();
+        size_t last =
+            std::upper_bound(points.begin() + first, points.end(), x_max,
+                             [](double x, Point const &point)
+                             { return x < point.x; }) -
+            points.begin();
+        first = first > 0 ? first - 1 : 0;
+        last = std::min(last + 1, points.size());
+        const size_t count = last - first;
+        if (count <= 2 * std::max<size_t>(buckets, 1) || levels.empty())
+            return std::vector<Point>(points.begin() + first,
+                                      points.begin() + last);
+
+        // Smallest level with at most buckets buckets in the range.
+        size_t level = 1;
+        while (level < levels.size() && (count >> level) >= buckets) ++level;
+
+        std::vector<Point> sampled;
+        sampled.reserve(2 * ((count >> level) + 2) + 2);
+        sampled.push_back(points[first]);
+        size_t kept = first;
+        auto keep = [&](size_t index)
+        {
+            if (index <= kept || index >= last - 1) return;
+            sampled.push_back(points[index]);
+            kept = index;
+        };
+        std::vector<Envelope> const &envelopes = levels[level - 1];
+        for (size_t bucket = first >> level; bucket <= (last - 1) >> level;
+             ++bucket)
+        {
+            Envelope const &envelope = envelopes[bucket];
+            keep(std::min(envelope.min, envelope.max));
+            keep(std::max(envelope.min, envelope.max));
+        }
+        sampled.push_back(points[last - 1]);
+        return sampled;
+    }
 
-    std::vector<Point> points;
+   private:
+    struct Envelope
+    {
+        size_t min;
+        size_t max;
+    };
+    // levels[k - 1] holds the envelopes of the buckets of 2^k points.
+    std::vector<std::vector<Envelope>> levels;
 };
 
+// Simplifies every Polyline or Polygon of a vector in parallel.
+template <typename T>
+void simplifyShapes(std::vector<T> &shapes, double tolerance,
+                    Layout const &layout,
+                    ThreadPool &pool = defaultThreadPool())
+{
+    pool.parallelFor(shapes.size(), [&](size_t i)
+                     { shapes[i].simplify(tolerance, layout); });
+}
+
 class Text : public Shape
 {
    public:
@@ -601,38 +2036,38 @@ class Text : public Shape
           dominant_baseline(dominant_baseline)
     {
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("text") << attribute("x", translateX(origin.x, layout))
-           << attribute("y", translateY(origin.y, layout));
+        writer.elemStart("text")
+            .attribute("x", translateX(origin.x, layout))
+            .attribute("y", translateY(origin.y, layout));
 
         if (rotation != 0)
         {
-            ss << attribute(
-                "transform",
-                "rotate(" + std::to_string(-rotation) + " " +
-                    std::to_string(translateX(origin.x, layout)) + " " +
-                    std::to_string(translateY(origin.y, layout)) + ")");
+            writer << "transform=\"rotate(";
+            writer.fixed(-rotation) << ' ';
+            writer.fixed(translateX(origin.x, layout)) << ' ';
+            writer.fixed(translateY(origin.y, layout)) << ")\" ";
         }
 
         if (!text_anchor.empty())
         {
-            ss << attribute("text-anchor", text_anchor);
+            writer.attribute("text-anchor", text_anchor);
         }
 
         if (!dominant_baseline.empty())
         {
-            ss << attribute("dominant-baseline", dominant_baseline);
+            writer.attribute("dominant-baseline", dominant_baseline);
         }
 
-        ss << fill.toString(layout) << stroke.toString(layout)
-           << font.toString(layout) << ">" << content << elemEnd("text");
-        return ss.str();
+        serializeStyle(writer, layout, fill, stroke, font);
+        writer << '>' << content;
+        writer.elemEnd("text");
     }
 
     void offset(Point const &offset) override
     {
+        touch();
         origin.x += offset.x;
         origin.y += offset.y;
     }
@@ -641,14 +2076,47 @@ class Text : public Shape
     {
         return std::make_unique<Text>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    // Glyph metrics are unknown, so this assumes every byte of content is
+    // at most one em wide and allows one em above and below the baseline.
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        Point anchor(translateX(origin.x, layout),
+                     translateY(origin.y, layout));
+        double em = font.height(layout);
+        double width = em * content.size();
+        Box box(anchor, anchor);
+        if (rotation != 0)
+            box.expand(std::hypot(width, em));
+        else if (text_anchor.empty() || text_anchor == "start")
+            box = Box(Point(anchor.x, anchor.y - em),
+                      Point(anchor.x + width, anchor.y + em));
+        else
+            box = Box(Point(anchor.x - width, anchor.y - em),
+                      Point(anchor.x + width, anchor.y + em));
+        return box.expand(stroke.extent(layout));
+    }
 
-    void setRotation(double angle) { rotation = angle; }
+    void setRotation(double angle)
+    {
+        rotation = angle;
+        touch();
+    }
 
-    void setTextAnchor(std::string const &anchor) { text_anchor = anchor; }
+    void setTextAnchor(std::string const &anchor)
+    {
+        text_anchor = anchor;
+        touch();
+    }
 
     void setDominantBaseline(std::string const &baseline)
     {
         dominant_baseline = baseline;
+        touch();
     }
 
    private:
@@ -669,64 +2137,139 @@ class LineChart : public Shape
         : axis_stroke(axis_stroke), margin(margin), scale(scale)
     {
     }
+    // Opt-in downsampling: series are reduced with downsampleLTTB() to about
+    // points_per_pixel points per horizontal pixel they span in the layout.
+    // Series must be ordered by x.  0 disables downsampling.
+    void setDownsampling(double points_per_pixel)
+    {
+        downsampling = points_per_pixel;
+        touch();
+    }
+    // Opt-in level of detail: each series gets a PolylinePyramid, and only
+    // the part visible in the layout is drawn, with about two points per
+    // pixel, in time proportional to that output.  Series must be ordered
+    // by x.  Takes precedence over setDownsampling().
+    void setLevelOfDetail(bool enabled)
+    {
+        touch();
+        level_of_detail = enabled;
+        pyramids.clear();
+        if (!enabled) return;
+        for (Polyline const &polyline : polylines)
+            pyramids.emplace_back(polyline.points);
+    }
+    // Encoding of the series polylines.
+    void setEncoding(PointEncoding new_encoding)
+    {
+        encoding = new_encoding;
+        touch();
+    }
     LineChart &operator<<(Polyline const &polyline)
     {
         if (polyline.points.empty()) return *this;
 
+        touch();
         polylines.push_back(polyline);
+        if (level_of_detail) pyramids.emplace_back(polyline.points);
+        // Recomputed rather than trusted, as points may have been filled
+        // in directly.
+        polylines.back().updateBounds();
+        Point min = *polylines.back().minPoint();
+        Point max = *polylines.back().maxPoint();
+        if (polylines.size() == 1)
+        {
+            min_point = min;
+            max_point = max;
+            return *this;
+        }
+        if (min.x < min_point.x) min_point.x = min.x;
+        if (min.y < min_point.y) min_point.y = min.y;
+        if (max.x > max_point.x) max_point.x = max.x;
+        if (max.y > max_point.y) max_point.y = max.y;
         return *this;
     }
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        if (polylines.empty()) return "";
+        if (polylines.empty()) return;
 
-        std::string ret;
+        double vertex_diameter = getSize()->height / 30.0;
         for (unsigned i = 0; i < polylines.size(); ++i)
-            ret += polylineToString(polylines[i], layout);
+            serializePolyline(writer, i, vertex_diameter, layout);
 
-        return ret + axisString(layout);
+        serializeAxis(writer, layout);
     }
     void offset(Point const &offset) override
     {
+        touch();
         for (unsigned i = 0; i < polylines.size(); ++i)
             polylines[i].offset(offset);
+        min_point.x += offset.x;
+        min_point.y += offset.y;
+        max_point.x += offset.x;
+        max_point.y += offset.y;
     }
 
     virtual std::unique_ptr<Shape> clone() const override
     {
         return std::make_unique<LineChart>(*this);
     }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    // Series, their vertex markers and the axis.  Downsampling only drops
+    // points, so it never grows the bounds.
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        std::optional<Size> size = getSize();
+        if (!size) return std::nullopt;
+
+        double dx = translateScale(margin.width, layout);
+        double dy = translateScale(margin.height, layout);
+        double vertex_radius = translateScale(size->height / 60.0, layout);
+        Box box = translateBox(
+            Point(margin.width, margin.height),
+            Point(margin.width + size->width * 1.1,
+                  margin.height + size->height * 1.1),
+            layout);
+        box.expand(joinExtent(axis_stroke, layout));
+        for (Polyline const &polyline : polylines)
+        {
+            Box series = *polyline.bounds(layout);
+            series.min.x += dx;
+            series.max.x += dx;
+            series.min.y -= dy;
+            series.max.y -= dy;
+            box.merge(series.expand(vertex_radius));
+        }
+        return box;
+    }
 
    private:
     Stroke axis_stroke;
     Size margin;
     double scale;
+    double downsampling = 0;
+    bool level_of_detail = false;
+    PointEncoding encoding = PointEncoding::Points;
     std::vector<Polyline> polylines;
+    // One per polyline when level_of_detail is set.
+    std::vector<PolylinePyramid> pyramids;
+    // Bounds of all polylines, updated as they are added.
+    Point min_point;
+    Point max_point;
 
     std::optional<Size> getSize() const
     {
         if (polylines.empty()) return std::nullopt;
 
-        std::optional<Point> min = getMinPoint(polylines[0].points);
-        std::optional<Point> max = getMaxPoint(polylines[0].points);
-        for (unsigned i = 0; i < polylines.size(); ++i)
-        {
-            if (getMinPoint(polylines[i].points)->x < min->x)
-                min->x = getMinPoint(polylines[i].points)->x;
-            if (getMinPoint(polylines[i].points)->y < min->y)
-                min->y = getMinPoint(polylines[i].points)->y;
-            if (getMaxPoint(polylines[i].points)->x > max->x)
-                max->x = getMaxPoint(polylines[i].points)->x;
-            if (getMaxPoint(polylines[i].points)->y > max->y)
-                max->y = getMaxPoint(polylines[i].points)->y;
-        }
-
-        return Size(max->x - min->x, max->y - min->y);
+        return Size(max_point.x - min_point.x, max_point.y - min_point.y);
     }
-    std::string axisString(Layout const &layout) const
+    void serializeAxis(Writer &writer, Layout const &layout) const
     {
         std::optional<Size> size = getSize();
-        if (!size) return "";
+        if (!size) return;
 
         // Make the axis 10% wider and higher than the data points.
         double width = size->width * 1.1;
@@ -738,62 +2281,137 @@ class LineChart : public Shape
              << Point(margin.width, margin.height)
              << Point(margin.width + width, margin.height);
 
-        return axis.toString(layout);
-    }
-    std::string polylineToString(Polyline const &polyline,
-                                 Layout const &layout) const
-    {
-        Polyline shifted_polyline = polyline;
+        axis.serialize(writer, layout);
+    }
+    size_t downsampleThreshold(Polyline const &polyline,
+                               Layout const &layout) const
+    {
+        double span = polyline.maxPoint()->x - polyline.minPoint()->x;
+        double pixels =
+            std::min(translateScale(span, layout), layout.size.width);
+        return std::max<size_t>(3, size_t(std::ceil(pixels * downsampling)));
+    }
+    // Points of a series in the part of the layout it is drawn in.
+    std::vector<Point> visiblePoints(size_t index, Layout const &layout) const
+    {
+        Polyline const &polyline = polylines[index];
+        double x_min = -layout.origin_offset.x - margin.width;
+        double x_max = x_min + layout.size.width / layout.scale;
+        x_min = std::max(x_min, polyline.minPoint()->x);
+        x_max = std::min(x_max, polyline.maxPoint()->x);
+        size_t pixels =
+            x_max > x_min ? size_t(std::ceil(translateScale(x_max - x_min,
+                                                            layout)))
+                          : 1;
+        return pyramids[index].view(polyline.points, x_min, x_max, pixels);
+    }
+    void serializePolyline(Writer &writer, size_t index,
+                           double vertex_diameter, Layout const &layout) const
+    {
+        Polyline const &polyline = polylines[index];
+        Polyline shifted_polyline =
+            level_of_detail
+                ? polyline.withPoints(visiblePoints(index, layout))
+            : downsampling > 0
+                ? polyline.withPoints(downsampleLTTB(
+                      polyline.points, downsampleThreshold(polyline, layout)))
+                : polyline;
         shifted_polyline.offset(Point(margin.width, margin.height));
+        shifted_polyline.setEncoding(encoding);
 
-        std::vector<Circle> vertices;
+        shifted_polyline.serialize(writer, layout);
         for (unsigned i = 0; i < shifted_polyline.points.size(); ++i)
-            vertices.push_back(Circle(shifted_polyline.points[i],
-                                      getSize()->height / 30.0,
-                                      Fill(Color::Black)));
-
-        return shifted_polyline.toString(layout) +
-               vectorToString(vertices, layout);
+            Circle(shifted_polyline.points[i], vertex_diameter,
+                   Fill(Color::Black))
+                .serialize(writer, layout);
     }
 };
 
 class Group : public Shape
 {
    public:
-    explicit Group(std::string const &id = "") : id(id) {}
-
-    // Copy constructor that performs a deep copy
-    Group(const Group &other) : id(other.id)
-    {
-        shapes.reserve(other.shapes.size());
-        std::transform(other.shapes.begin(), other.shapes.end(),
-                       std::back_inserter(shapes),
-                       [](const auto &child) { return child->clone(); });
+    // Inserted shapes, and the group's list of children, are allocated from
+    // resource, e.g. a std::pmr::monotonic_buffer_resource holding the whole
+    // scene.  The resource must outlive the group and every copy of it.
+    explicit Group(std::string const &id = "",
+                   std::pmr::memory_resource *resource =
+                       std::pmr::get_default_resource())
+        : id(id), resource(resource), shapes(resource), borrowed(resource)
+    {
+    }
+
+    // Children are immutable nodes shared between copies, so copying a group
+    // copies only its child pointers.  A shared child is cloned the first
+    // time a mutation such as offset() reaches it.
+    Group(const Group &other) : Group(other, other.resource) {}
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    Group(const Group &other, allocator_type allocator)
+        : Shape(other),
+          id(other.id),
+          resource(allocator.resource()),
+          shapes(other.shapes, allocator),
+          borrowed(other.borrowed, allocator),
+          culling(other.culling)
+    {
+    }
+    // Keeps allocating from this group's own resource.
+    Group &operator=(const Group &other)
+    {
+        Shape::operator=(other);
+        id = other.id;
+        shapes = other.shapes;
+        borrowed = other.borrowed;
+        culling = other.culling;
+        return *this;
     }
 
-    std::string toString(Layout const &layout) const override
+    void serialize(Writer &writer, Layout const &layout) const override
     {
-        std::stringstream ss;
-        ss << elemStart("g");
+        writer.elemStart("g");
         if (!id.empty())
         {
-            ss << attribute("id", id);
+            writer.attribute("id", id);
         }
-        ss << ">\n";
+        writer << ">\n";
 
         for (const auto &child : shapes)
         {
-            ss << "\t" << child->toString(layout);
+            if (culling && !isVisible(*child, layout)) continue;
+            writer << '\t';
+            child->serialize(writer, layout);
+        }
+        writer << '\t';
+        writer.elemEnd("g");
+    }
+    // Same output as serialize(), with the children serialized on pool.
+    void serialize(Writer &writer, Layout const &layout,
+                   ThreadPool &pool) const
+    {
+        writer.elemStart("g");
+        if (!id.empty())
+        {
+            writer.attribute("id", id);
         }
-        ss << "\t" << elemEnd("g");
-        return ss.str();
+        writer << ">\n";
+
+        serializeParallel(writer, shapes, layout, pool, "\t", culling);
+        writer << '\t';
+        writer.elemEnd("g");
+    }
+    using Serializeable::toString;
+    std::string toString(Layout const &layout, ThreadPool &pool) const
+    {
+        Writer writer;
+        serialize(writer, layout, pool);
+        return writer.take();
     }
 
     void offset(Point const &offset) override
     {
-        for (auto &child : shapes)
+        touch();
+        for (size_t i = 0; i < shapes.size(); ++i)
         {
-            child->offset(offset);
+            mutableChild(i).offset(offset);
         }
     }
 
@@ -801,10 +2419,48 @@ class Group : public Shape
     {
         return std::make_unique<Group>(*this);
     }
-
-    Group &operator<<(Shape const &shape)
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
     {
-        shapes.push_back(shape.clone());
+        return allocateShape(*this, resource);
+    }
+    // Union of the children, unknown if any child's bounds are.
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        std::optional<Box> box;
+        for (const auto &child : shapes)
+        {
+            std::optional<Box> child_box = child->bounds(layout);
+            if (!child_box) return std::nullopt;
+            if (box)
+                box->merge(*child_box);
+            else
+                box = child_box;
+        }
+        return box;
+    }
+
+    // Skips children lying entirely outside the layout's canvas when
+    // serializing.
+    void setCulling(bool enabled)
+    {
+        culling = enabled;
+        touch();
+    }
+
+    Group &operator<<(Shape const &shape)
+    {
+        touch();
+        shapes.push_back(shape.cloneInto(resource));
+        borrowed.push_back(false);
+        return *this;
+    }
+    // Inserts a node without copying it; it is shared, not modified.
+    Group &operator<<(std::shared_ptr<const Shape> shape)
+    {
+        touch();
+        shapes.push_back(std::move(shape));
+        borrowed.push_back(true);
         return *this;
     }
 
@@ -812,11 +2468,929 @@ class Group : public Shape
 
     bool empty() const { return shapes.empty(); }
 
+    std::string const &getId() const { return id; }
+
+    std::span<const std::shared_ptr<const Shape>> children() const
+    {
+        return shapes;
+    }
+
+   private:
+    std::string id;
+    std::pmr::memory_resource *resource;
+    std::pmr::vector<std::shared_ptr<const Shape>> shapes;
+    // Whether each child was inserted as a node owned by the caller.
+    std::pmr::vector<bool> borrowed;
+    bool culling = false;
+
+    // Returns child i for modification, first replacing it with a private
+    // clone if it was inserted by pointer or other groups share it.  Other
+    // children were created by cloneInto() as non-const objects, so casting
+    // away const on an unshared one is safe.
+    Shape &mutableChild(size_t i)
+    {
+        std::shared_ptr<const Shape> &child = shapes[i];
+        if (borrowed[i] || child.use_count() > 1)
+        {
+            child = child->cloneInto(resource);
+            borrowed[i] = false;
+        }
+        return const_cast<Shape &>(*child);
+    }
+};
+
+// Group of shapes stored by value, contiguously, as variants of Types.
+// Serializing, offsetting and bounding dispatch with std::visit to the
+// concrete types instead of through the Shape vtable, and inserting a shape
+// allocates nothing once the storage has grown.  Serializes like a Group of
+// the same shapes, and inserts into a Group or Document as one shape.
+template <typename... Types>
+class BasicValueGroup : public Shape
+{
+   public:
+    using value_type = std::variant<Types...>;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    explicit BasicValueGroup(std::string const &id = "",
+                             allocator_type allocator = {})
+        : id(id), items(allocator)
+    {
+    }
+    BasicValueGroup(BasicValueGroup const &other) = default;
+    BasicValueGroup(BasicValueGroup const &other, allocator_type allocator)
+        : Shape(other), id(other.id), items(other.items, allocator)
+    {
+    }
+
+    void serialize(Writer &writer, Layout const &layout) const override
+    {
+        writer.elemStart("g");
+        if (!id.empty())
+        {
+            writer.attribute("id", id);
+        }
+        writer << ">\n";
+
+        for (value_type const &item : items)
+            detail::serializeShape(item, writer << '\t', layout);
+        writer << '\t';
+        writer.elemEnd("g");
+    }
+    // Same output as serialize(), with the shapes serialized on pool.
+    void serialize(Writer &writer, Layout const &layout,
+                   ThreadPool &pool) const
+    {
+        writer.elemStart("g");
+        if (!id.empty())
+        {
+            writer.attribute("id", id);
+        }
+        writer << ">\n";
+
+        serializeParallel(writer, items, layout, pool, "\t");
+        writer << '\t';
+        writer.elemEnd("g");
+    }
+    void offset(Point const &offset) override
+    {
+        touch();
+        for (value_type &item : items)
+            std::visit(
+                [&](auto &shape)
+                {
+                    using Item = std::decay_t<decltype(shape)>;
+                    shape.Item::offset(offset);
+                },
+                item);
+    }
+
+    virtual std::unique_ptr<Shape> clone() const override
+    {
+        return std::make_unique<BasicValueGroup>(*this);
+    }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    // Union of the shapes, unknown if any shape's bounds are.
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        std::optional<Box> box;
+        for (value_type const &item : items)
+        {
+            std::optional<Box> item_box = std::visit(
+                [&](auto const &shape)
+                {
+                    using Item = std::decay_t<decltype(shape)>;
+                    return shape.Item::bounds(layout);
+                },
+                item);
+            if (!item_box) return std::nullopt;
+            if (box)
+                box->merge(*item_box);
+            else
+                box = item_box;
+        }
+        return box;
+    }
+
+    template <typename T>
+    BasicValueGroup &operator<<(T &&shape)
+    {
+        touch();
+        items.emplace_back(std::forward<T>(shape));
+        return *this;
+    }
+    void reserve(size_t count) { items.reserve(count); }
+
+    size_t size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+    value_type const &operator[](size_t index) const { return items[index]; }
+    // Counts as a mutation, as the shape may be changed through the result.
+    value_type &operator[](size_t index)
+    {
+        touch();
+        return items[index];
+    }
+
+   private:
+    std::string id;
+    std::pmr::vector<value_type> items;
+};
+
+// Value group of the basic shapes.
+using ValueGroup = BasicValueGroup<Circle, Elipse, Rectangle, Line, Polygon,
+                                   Polyline, Text>;
+
+namespace detail
+{
+// Style attributes shared by the items of a batch, formatted once per
+// serialization.  Items with a color of their own get it as their fill.
+class BatchStyle
+{
+   public:
+    BatchStyle(Writer const &writer, Layout const &layout, Fill const &fill,
+               Stroke const &stroke, bool item_colors)
+        : layout(layout), stroke(stroke), sheet(writer.getStyleSheet())
+    {
+        text.setFormat(writer);
+        text.setStyleSheet(sheet);
+        if (!item_colors)
+            serializeStyle(text, layout, fill, stroke);
+        else if (!sheet)
+            serializeStyle(text, layout, stroke);
+    }
+    void serialize(Writer &writer, Color const *color) const
+    {
+        if (color && sheet)
+        {
+            serializeStyle(writer, layout, Fill(*color), stroke);
+            return;
+        }
+        if (color) Fill(*color).serialize(writer, layout);
+        writer << text.str();
+    }
+
+   private:
+    Layout const &layout;
+    Stroke const &stroke;
+    StyleSheet *sheet;
+    Writer text;
+};
+}  // namespace detail
+
+// Many circles sharing one style, stored as arrays of centers, radii and,
+// optionally, per-circle fill colors.  Serializes like the same Circles in
+// one loop, with the shared style formatted once.
+class CircleBatch : public Shape
+{
+   public:
+    explicit CircleBatch(Fill const &fill = Fill(),
+                         Stroke const &stroke = Stroke())
+        : Shape(fill, stroke)
+    {
+    }
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    CircleBatch(CircleBatch const &other, allocator_type allocator)
+        : Shape(other),
+          centers(other.centers, allocator),
+          radii(other.radii, allocator),
+          colors(other.colors, allocator)
+    {
+    }
+
+    // Once any circle has a color, those added without one are filled
+    // with the batch fill's color.
+    CircleBatch &add(Point const &center, double diameter)
+    {
+        if (!colors.empty()) colors.push_back(fill.getColor());
+        return push(center, diameter);
+    }
+    CircleBatch &add(Point const &center, double diameter, Color const &color)
+    {
+        // Colors take the capacity reserved for the circles once used.
+        if (colors.empty()) colors.reserve(centers.capacity());
+        colors.resize(centers.size(), fill.getColor());
+        colors.push_back(color);
+        return push(center, diameter);
+    }
+    void reserve(size_t count)
+    {
+        centers.reserve(count);
+        radii.reserve(count);
+        if (!colors.empty()) colors.reserve(count);
+    }
+    size_t size() const { return centers.size(); }
+    bool empty() const { return centers.empty(); }
+
+    void serialize(Writer &writer, Layout const &layout) const override
+    {
+        detail::BatchStyle style(writer, layout, fill, stroke,
+                                 !colors.empty());
+        Writer radius_text;
+        radius_text.setFormat(writer);
+        double radius = std::nan("");
+        const size_t block_size = 256;
+        double coordinates[2 * block_size];
+        for (size_t first = 0; first < centers.size(); first += block_size)
+        {
+            size_t count = std::min(block_size, centers.size() - first);
+            translatePoints(centers.data() + first, count, layout,
+                            coordinates);
+            for (size_t i = 0; i < count; ++i)
+            {
+                // Scatter plots mostly repeat one radius; format it once.
+                if (radii[first + i] != radius)
+                {
+                    radius = radii[first + i];
+                    radius_text.clear();
+                    radius_text.attribute("r", translateScale(radius, layout));
+                }
+                writer.elemStart("circle")
+                    .attribute("cx", coordinates[2 * i])
+                    .attribute("cy", coordinates[2 * i + 1])
+                    << radius_text.str();
+                style.serialize(writer,
+                                colors.empty() ? nullptr : &colors[first + i]);
+                writer.emptyElemEnd();
+            }
+        }
+    }
+    void offset(Point const &offset) override
+    {
+        touch();
+        for (Point &center : centers)
+        {
+            center.x += offset.x;
+            center.y += offset.y;
+        }
+    }
+
+    virtual std::unique_ptr<Shape> clone() const override
+    {
+        return std::make_unique<CircleBatch>(*this);
+    }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        std::optional<Box> box;
+        for (size_t i = 0; i < centers.size(); ++i)
+        {
+            Box item = translateBox(centers[i], centers[i], layout)
+                           .expand(translateScale(radii[i], layout));
+            if (box)
+                box->merge(item);
+            else
+                box = item;
+        }
+        if (box) box->expand(stroke.extent(layout));
+        return box;
+    }
+
+   private:
+    std::pmr::vector<Point> centers;
+    std::pmr::vector<double> radii;
+    std::pmr::vector<Color> colors;
+
+    CircleBatch &push(Point const &center, double diameter)
+    {
+        touch();
+        centers.push_back(center);
+        radii.push_back(diameter / 2);
+        return *this;
+    }
+};
+
+// Many rectangles sharing one style, stored as arrays of corners, sizes
+// and, optionally, per-rectangle fill colors.  Serializes like the same
+// Rectangles in one loop, with the shared style formatted once.
+class RectBatch : public Shape
+{
+   public:
+    explicit RectBatch(Fill const &fill = Fill(),
+                       Stroke const &stroke = Stroke())
+        : Shape(fill, stroke)
+    {
+    }
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+    RectBatch(RectBatch const &other, allocator_type allocator)
+        : Shape(other),
+          edges(other.edges, allocator),
+          sizes(other.sizes, allocator),
+          colors(other.colors, allocator)
+    {
+    }
+
+    // Once any rectangle has a color, those added without one are filled
+    // with the batch fill's color.
+    RectBatch &add(Point const &edge, double width, double height)
+    {
+        if (!colors.empty()) colors.push_back(fill.getColor());
+        return push(edge, width, height);
+    }
+    RectBatch &add(Point const &edge, double width, double height,
+                   Color const &color)
+    {
+        // Colors take the capacity reserved for the rectangles once used.
+        if (colors.empty()) colors.reserve(edges.capacity());
+        colors.resize(edges.size(), fill.getColor());
+        colors.push_back(color);
+        return push(edge, width, height);
+    }
+    void reserve(size_t count)
+    {
+        edges.reserve(count);
+        sizes.reserve(count);
+        if (!colors.empty()) colors.reserve(count);
+    }
+    size_t size() const { return edges.size(); }
+    bool empty() const { return edges.empty(); }
+
+    void serialize(Writer &writer, Layout const &layout) const override
+    {
+        detail::BatchStyle style(writer, layout, fill, stroke,
+                                 !colors.empty());
+        const size_t block_size = 256;
+        double coordinates[2 * block_size];
+        for (size_t first = 0; first < edges.size(); first += block_size)
+        {
+            size_t count = std::min(block_size, edges.size() - first);
+            translatePoints(edges.data() + first, count, layout, coordinates);
+            for (size_t i = 0; i < count; ++i)
+            {
+                Size const &size = sizes[first + i];
+                // As Rectangle, y is offset by the unscaled height.
+                writer.elemStart("rect")
+                    .attribute("x", coordinates[2 * i])
+                    .attribute("y", coordinates[2 * i + 1] - size.height)
+                    .attribute("width", translateScale(size.width, layout))
+                    .attribute("height", translateScale(size.height, layout));
+                style.serialize(writer,
+                                colors.empty() ? nullptr : &colors[first + i]);
+                writer.emptyElemEnd();
+            }
+        }
+    }
+    void offset(Point const &offset) override
+    {
+        touch();
+        for (Point &edge : edges)
+        {
+            edge.x += offset.x;
+            edge.y += offset.y;
+        }
+    }
+
+    virtual std::unique_ptr<Shape> clone() const override
+    {
+        return std::make_unique<RectBatch>(*this);
+    }
+    std::shared_ptr<Shape> cloneInto(
+        std::pmr::memory_resource *resource) const override
+    {
+        return allocateShape(*this, resource);
+    }
+    std::optional<Box> bounds(Layout const &layout) const override
+    {
+        std::optional<Box> box;
+        for (size_t i = 0; i < edges.size(); ++i)
+        {
+            Point corner(translateX(edges[i].x, layout),
+                         translateY(edges[i].y, layout) - sizes[i].height);
+            Box item = Box::spanning(
+                corner,
+                Point(corner.x + translateScale(sizes[i].width, layout),
+                      corner.y + translateScale(sizes[i].height, layout)));
+            if (box)
+                box->merge(item);
+            else
+                box = item;
+        }
+        if (box) box->expand(stroke.extent(layout));
+        return box;
+    }
+
    private:
+    std::pmr::vector<Point> edges;
+    std::pmr::vector<Size> sizes;
+    std::pmr::vector<Color> colors;
+
+    RectBatch &push(Point const &edge, double width, double height)
+    {
+        touch();
+        edges.push_back(edge);
+        sizes.push_back(Size(width, height));
+        return *this;
+    }
+};
+
+// Packed R-tree over the children of a group, bulk-loaded with
+// Sort-Tile-Recursive packing, for region and hit queries in O(log n + k).
+// Bounds are taken for the layout given at construction, so query regions
+// are in its SVG native space.  The index shares the children, so later
+// changes to the group do not affect it.  Children with unknown bounds
+// match every query.
+class SpatialIndex
+{
+   public:
+    SpatialIndex(Group const &group, Layout const &layout)
+        : id(group.getId()),
+          layout(layout),
+          shapes(group.children().begin(), group.children().end())
+    {
+        std::vector<Node> entries;
+        entries.reserve(shapes.size());
+        for (size_t i = 0; i < shapes.size(); ++i)
+        {
+            std::optional<Box> box = shapes[i]->bounds(layout);
+            if (box)
+                entries.push_back(Node{*box, i, 0});
+            else
+                unbounded.push_back(i);
+        }
+        // Level 0 holds one entry per child, with first being its index.
+        // Each further level holds the nodes over ranges of the one below.
+        levels.push_back(std::move(entries));
+        while (levels.back().size() > 1)
+            levels.push_back(pack(levels.back()));
+    }
+
+    // Indices of the children whose bounds intersect region, in group
+    // order.
+    std::vector<size_t> intersecting(Box const &region) const
+    {
+        std::vector<size_t> found(unbounded);
+        search(region, found);
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+    // Indices of the children whose bounds contain point, in group order.
+    std::vector<size_t> containing(Point const &point) const
+    {
+        return intersecting(Box(point, point));
+    }
+
+    // Group with the same id holding the children that intersect region.
+    Group select(Box const &region,
+                 std::pmr::memory_resource *resource =
+                     std::pmr::get_default_resource()) const
+    {
+        Group group(id, resource);
+        for (size_t i : intersecting(region)) group << shapes[i];
+        return group;
+    }
+    // Serializes the group as it was indexed, keeping only the children
+    // that intersect region.
+    void serialize(Writer &writer, Box const &region) const
+    {
+        select(region).serialize(writer, layout);
+    }
+
+    std::shared_ptr<const Shape> const &child(size_t index) const
+    {
+        return shapes[index];
+    }
+    size_t size() const { return shapes.size(); }
+    Layout const &getLayout() const { return layout; }
+
+   private:
+    struct Node
+    {
+        Box box;
+        size_t first;
+        size_t count;
+    };
+    static constexpr size_t node_size = 16;
+
     std::string id;
-    std::vector<std::unique_ptr<Shape>> shapes;
+    Layout layout;
+    std::vector<std::shared_ptr<const Shape>> shapes;
+    std::vector<size_t> unbounded;
+    std::vector<std::vector<Node>> levels;
+
+    // Sorts nodes into vertical slices by x, and each slice by y, then
+    // returns parents over consecutive runs of node_size.
+    static std::vector<Node> pack(std::vector<Node> &nodes)
+    {
+        const size_t count = nodes.size();
+        const size_t parent_count = (count + node_size - 1) / node_size;
+        const size_t slices = size_t(std::ceil(std::sqrt(parent_count)));
+        const size_t slice_size = slices * node_size;
+        std::sort(nodes.begin(), nodes.end(),
+                  [](Node const &a, Node const &b)
+                  { return a.box.min.x + a.box.max.x <
+                           b.box.min.x + b.box.max.x; });
+
+        std::vector<Node> parents;
+        parents.reserve(parent_count);
+        for (size_t slice = 0; slice < count; slice += slice_size)
+        {
+            size_t slice_end = std::min(count, slice + slice_size);
+            std::sort(nodes.begin() + slice, nodes.begin() + slice_end,
+                      [](Node const &a, Node const &b)
+                      { return a.box.min.y + a.box.max.y <
+                               b.box.min.y + b.box.max.y; });
+            for (size_t first = slice; first < slice_end; first += node_size)
+            {
+                size_t last = std::min(slice_end, first + node_size);
+                Box box = nodes[first].box;
+                for (size_t i = first + 1; i < last; ++i)
+                    box.merge(nodes[i].box);
+                parents.push_back(Node{box, first, last - first});
+            }
+        }
+        return parents;
+    }
+    void search(Box const &region, std::vector<size_t> &found) const
+    {
+        if (levels.front().empty()) return;
+
+        // Pending (level, node) pairs, starting from the single root.
+        std::vector<std::pair<size_t, size_t>> pending{{levels.size() - 1, 0}};
+        while (!pending.empty())
+        {
+            auto [level, index] = pending.back();
+            pending.pop_back();
+            Node const &node = levels[level][index];
+            if (!node.box.intersects(region)) continue;
+            if (level == 0)
+            {
+                found.push_back(node.first);
+                continue;
+            }
+            for (size_t i = node.first; i < node.first + node.count; ++i)
+                pending.emplace_back(level - 1, i);
+        }
+    }
+};
+
+// XML prolog and opening <svg> tag shared by the document classes.
+void serializeDocumentHeader(Writer &writer, Layout const &layout)
+{
+    writer << "<?xml ";
+    writer.attribute("version", "1.0").attribute("standalone", "no")
+        << "?>\n<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
+        << "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n<svg ";
+    writer.attribute("width", layout.size.width, "px")
+        .attribute("height", layout.size.height, "px")
+        .attribute("xmlns", "http://www.w3.org/2000/svg")
+        .attribute("version", "1.1")
+        << ">\n";
+}
+void serializeDocumentFooter(Writer &writer) { writer.elemEnd("svg"); }
+std::string documentHeader(Layout const &layout)
+{
+    Writer writer;
+    serializeDocumentHeader(writer, layout);
+    return writer.take();
+}
+std::string documentFooter() { return elemEnd("svg"); }
+
+// Outcome of writing a file.
+struct SaveResult
+{
+    bool ok = false;
+    size_t bytes_written = 0;
+
+    explicit operator bool() const { return ok; }
+};
+
+// Writes pieces to a new file in order without joining them, with
+// vectored writes (writev) where available.  Fails on any error.
+SaveResult writeFile(std::string const &file_name,
+                     std::span<const std::string_view> pieces)
+{
+    SaveResult result;
+#ifdef SIMPLER_SVG_POSIX_IO
+    int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return result;
+
+    std::vector<iovec> vectors;
+    vectors.reserve(pieces.size());
+    for (std::string_view piece : pieces)
+        if (!piece.empty())
+            vectors.push_back(
+                iovec{const_cast<char *>(piece.data()), piece.size()});
+
+    long max_vectors = ::sysconf(_SC_IOV_MAX);
+    if (max_vectors <= 0) max_vectors = 16;
+    bool ok = true;
+    size_t next = 0;
+    while (next < vectors.size())
+    {
+        int count = int(std::min(vectors.size() - next, size_t(max_vectors)));
+        ssize_t written = ::writev(fd, &vectors[next], count);
+        if (written < 0 && errno == EINTR) continue;
+        // Nothing written while data remains would otherwise loop forever.
+        if (written <= 0)
+        {
+            ok = false;
+            break;
+        }
+        // Skips what was written, which may end within a piece.
+        size_t left = size_t(written);
+        result.bytes_written += left;
+        while (next < vectors.size() && left >= vectors[next].iov_len)
+            left -= vectors[next++].iov_len;
+        if (left > 0)
+        {
+            vectors[next].iov_base =
+                static_cast<char *>(vectors[next].iov_base) + left;
+            vectors[next].iov_len -= left;
+        }
+    }
+    result.ok = ::close(fd) == 0 && ok;
+#else
+    std::ofstream ofs(file_name.c_str(), std::ios::binary);
+    for (std::string_view piece : pieces)
+    {
+        if (!ofs.write(piece.data(), piece.size())) break;
+        result.bytes_written += piece.size();
+    }
+    ofs.close();
+    result.ok = bool(ofs);
+#endif
+    return result;
+}
+
+// Writes files on a background thread, so that a renderer can build its
+// next document while the previous one is written.  At most max_pending
+// files wait to be written; write() blocks while that many are queued,
+// which bounds the memory held by finished documents.  The default of 2
+// double-buffers: one file being written while the next one is queued.
+class FileWriter
+{
+   public:
+    explicit FileWriter(size_t max_pending = 2)
+        : max_pending(std::max<size_t>(1, max_pending)),
+          thread([this] { writeLoop(); })
+    {
+    }
+    FileWriter(FileWriter const &) = delete;
+    FileWriter &operator=(FileWriter const &) = delete;
+    // Writes the files still queued, then stops.
+    ~FileWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        thread.join();
+    }
+
+    // Queues buffers to be written to file_name, in order.  The future
+    // holds whether that succeeded and the number of bytes written.
+    std::future<SaveResult> write(std::string file_name,
+                                  std::vector<std::string> buffers)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return jobs.size() < max_pending; });
+        jobs.emplace_back(std::move(file_name), std::move(buffers));
+        std::future<SaveResult> result = jobs.back().result.get_future();
+        lock.unlock();
+        changed.notify_all();
+        return result;
+    }
+    // Same, calling done(result) on the writer thread instead.  done must
+    // not throw.
+    void write(std::string file_name, std::vector<std::string> buffers,
+               std::function<void(SaveResult const &)> done)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return jobs.size() < max_pending; });
+        jobs.emplace_back(std::move(file_name), std::move(buffers),
+                          std::move(done));
+        lock.unlock();
+        changed.notify_all();
+    }
+    // Returns an empty string with the capacity of an already written
+    // buffer when there is one, to be filled with the next document.
+    std::string buffer()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (spare.empty()) return {};
+        std::string text = std::move(spare.back());
+        spare.pop_back();
+        return text;
+    }
+    // Waits until every queued file has been written.
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return jobs.empty() && !writing; });
+    }
+
+   private:
+    struct Job
+    {
+        Job(std::string file_name, std::vector<std::string> buffers,
+            std::function<void(SaveResult const &)> done = {})
+            : file_name(std::move(file_name)),
+              buffers(std::move(buffers)),
+              done(std::move(done))
+        {
+        }
+
+        std::string file_name;
+        std::vector<std::string> buffers;
+        std::promise<SaveResult> result;
+        std::function<void(SaveResult const &)> done;
+    };
+
+    size_t max_pending;
+    std::deque<Job> jobs;
+    std::vector<std::string> spare;
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool writing = false;
+    bool stopping = false;
+    std::thread thread;
+
+    void writeLoop()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            changed.wait(lock, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return;
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            writing = true;
+            lock.unlock();
+            changed.notify_all();
+
+            std::vector<std::string_view> pieces(job.buffers.begin(),
+                                                 job.buffers.end());
+            SaveResult result = writeFile(job.file_name, pieces);
+            if (job.done)
+                job.done(result);
+            else
+                job.result.set_value(result);
+
+            // Keeps the largest buffer for buffer() to hand out again.
+            auto largest = std::max_element(
+                job.buffers.begin(), job.buffers.end(),
+                [](std::string const &a, std::string const &b)
+                { return a.capacity() < b.capacity(); });
+
+            lock.lock();
+            if (largest != job.buffers.end() && spare.size() < max_pending)
+            {
+                largest->clear();
+                spare.push_back(std::move(*largest));
+            }
+            writing = false;
+            changed.notify_all();
+        }
+    }
+};
+
+#ifdef SIMPLER_SVG_USE_ZLIB
+// Stream buffer that gzip-compresses what is written to it into another
+// stream buffer as it goes, through fixed-size input and output buffers.
+class GzipStreambuf : public std::streambuf
+{
+   public:
+    explicit GzipStreambuf(std::streambuf *sink,
+                           int level = Z_DEFAULT_COMPRESSION,
+                           size_t buffer_size = 64 * 1024)
+        : sink(sink), input(buffer_size), output(buffer_size)
+    {
+        // 16 + 15: gzip header and trailer around a 32 KiB window.
+        ok = deflateInit2(&stream, level, Z_DEFLATED, 16 + 15, 8,
+                          Z_DEFAULT_STRATEGY) == Z_OK;
+        setp(input.data(), input.data() + input.size());
+    }
+    GzipStreambuf(GzipStreambuf const &) = delete;
+    GzipStreambuf &operator=(GzipStreambuf const &) = delete;
+    ~GzipStreambuf() override
+    {
+        finish();
+        deflateEnd(&stream);
+    }
+
+    // Compresses the remaining input and writes the gzip trailer; nothing
+    // can be written afterwards.  Returns false if anything failed.
+    bool finish()
+    {
+        if (!finished)
+        {
+            compress(Z_FINISH);
+            finished = true;
+            setp(nullptr, nullptr);
+        }
+        return ok;
+    }
+
+   protected:
+    int_type overflow(int_type c) override
+    {
+        if (finished || !compress(Z_NO_FLUSH)) return traits_type::eof();
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    int sync() override
+    {
+        if (finished) return ok ? 0 : -1;
+        return compress(Z_NO_FLUSH) && sink->pubsync() == 0 ? 0 : -1;
+    }
+
+   private:
+    std::streambuf *sink;
+    std::vector<char> input;
+    std::vector<char> output;
+    z_stream stream{};
+    bool ok = false;
+    bool finished = false;
+
+    // Deflates the buffered input and hands the result to the sink.
+    bool compress(int flush)
+    {
+        if (!ok) return false;
+
+        stream.next_in = reinterpret_cast<Bytef *>(pbase());
+        stream.avail_in = uInt(pptr() - pbase());
+        int result;
+        do
+        {
+            stream.next_out = reinterpret_cast<Bytef *>(output.data());
+            stream.avail_out = uInt(output.size());
+            result = deflate(&stream, flush);
+            std::streamsize produced = output.size() - stream.avail_out;
+            if (result == Z_STREAM_ERROR ||
+                sink->sputn(output.data(), produced) != produced)
+            {
+                ok = false;
+                break;
+            }
+        } while (stream.avail_out == 0 ||
+                 (flush == Z_FINISH && result != Z_STREAM_END));
+
+        setp(input.data(), input.data() + input.size());
+        return ok;
+    }
 };
 
+// Output stream writing a gzip-compressed file, e.g. for a
+// StreamingDocument that should produce .svgz directly.
+class GzipOfstream : public std::ostream
+{
+   public:
+    explicit GzipOfstream(std::string const &file_name,
+                          int level = Z_DEFAULT_COMPRESSION)
+        : std::ostream(nullptr),
+          file(file_name.c_str(), std::ios::binary),
+          gzip(file.rdbuf(), level)
+    {
+        rdbuf(&gzip);
+        if (!file.good()) setstate(std::ios::badbit);
+    }
+
+    // Finishes the gzip stream and closes the file.
+    bool close()
+    {
+        if (!gzip.finish()) setstate(std::ios::badbit);
+        file.close();
+        if (file.fail()) setstate(std::ios::badbit);
+        return !fail();
+    }
+
+   private:
+    std::ofstream file;
+    GzipStreambuf gzip;
+};
+#endif
+
 class Document
 {
    public:
@@ -828,40 +3402,603 @@ class Document
 
     Document &operator<<(Shape const &shape)
     {
-        body_nodes_str += shape.toString(layout);
+        if (!culling || isVisible(shape, layout)) shape.serialize(body, layout);
         return *this;
     }
+    // Appends a vector of shapes (or of pointers to shapes), serializing
+    // them on pool.  Same output as inserting them one by one.
+    template <typename T>
+    Document &insert(std::vector<T> const &shapes,
+                     ThreadPool &pool = defaultThreadPool())
+    {
+        serializeParallel(body, shapes, layout, pool, "", culling);
+        return *this;
+    }
+    // Drops shapes inserted from now on that lie entirely outside the
+    // canvas, e.g. when rendering a zoomed-in view of a large scene.
+    void setCulling(bool enabled) { culling = enabled; }
+    // Number formatting of the shapes inserted from now on.
+    void setPrecision(Precision const &precision)
+    {
+        body.setPrecision(precision);
+    }
+    // Color formatting of the shapes inserted from now on.
+    void setColorFormat(ColorFormat format) { body.setColorFormat(format); }
+    // Shapes inserted from now on reference their fill, stroke and font
+    // through CSS classes, each distinct style being written once in a
+    // <style> element after the header.  Copies of the document share its
+    // styles.
+    void setStyleInterning(bool enabled)
+    {
+        if (enabled && !styles) styles = std::make_shared<StyleSheet>();
+        body.setStyleSheet(enabled ? styles.get() : nullptr);
+    }
     std::string toString() const
     {
-        std::stringstream ss;
-        ss << "<?xml " << attribute("version", "1.0")
-           << attribute("standalone", "no")
-           << "?>\n<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" "
-           << "\"http://www.w3.org/Graphics/SVG/1.1/DTD/svg11.dtd\">\n<svg "
-           << attribute("width", layout.size.width, "px")
-           << attribute("height", layout.size.height, "px")
-           << attribute("xmlns", "http://www.w3.org/2000/svg")
-           << attribute("version", "1.1") << ">\n"
-           << body_nodes_str << elemEnd("svg");
-        return ss.str();
+        Writer writer(body.size() + 512);
+        writer.setFormat(body);
+        serializeHeader(writer);
+        writer << body.str();
+        serializeDocumentFooter(writer);
+        return writer.take();
     }
+    // Writes the header, body and footer straight from their buffers, so
+    // the document is never copied into one string.
     bool save() const
     {
-        std::ofstream ofs(file_name.c_str());
-        if (!ofs.good()) return false;
+        Writer header;
+        header.setFormat(body);
+        serializeHeader(header);
+        std::string footer = documentFooter();
+        std::string_view pieces[] = {header.str(), body.str(), footer};
+        return writeFile(file_name, pieces).ok;
+    }
+    // Hands the document text over to io to be written in the background,
+    // and empties the document, which keeps its layout and formatting, so
+    // that the next one can be built meanwhile.  The body continues in a
+    // buffer already written by io when there is one.
+    std::future<SaveResult> saveAsync(FileWriter &io)
+    {
+        return io.write(file_name, takeBuffers(io));
+    }
+    // Same, calling done(result) on the writer thread when written.
+    void saveAsync(FileWriter &io,
+                   std::function<void(SaveResult const &)> done)
+    {
+        io.write(file_name, takeBuffers(io), std::move(done));
+    }
+#ifdef SIMPLER_SVG_USE_ZLIB
+    // Saves gzip-compressed (.svgz), compressing as the text is written so
+    // the uncompressed document is never stored.
+    bool saveCompressed(int level = Z_DEFAULT_COMPRESSION) const
+    {
+        GzipOfstream out(file_name, level);
+        if (!out.good()) return false;
+
+        Writer header;
+        header.setFormat(body);
+        serializeHeader(header);
+        out << header.str() << body.str() << documentFooter();
+        return out.close();
+    }
+#endif
+
+    const std::string &filename() const { return file_name; }
 
-        ofs << toString();
-        ofs.close();
+   private:
+    std::string file_name;
+    Layout layout;
+    bool culling = false;
+    std::shared_ptr<StyleSheet> styles;
+
+    Writer body;
+
+    void serializeHeader(Writer &writer) const
+    {
+        serializeDocumentHeader(writer, layout);
+        if (styles) styles->serialize(writer);
+    }
+    // Moves the header, body and footer text out, leaving an empty body
+    // (and a new style sheet when interning).
+    std::vector<std::string> takeBuffers(FileWriter &io)
+    {
+        std::vector<std::string> buffers(3);
+        Writer header;
+        header.setFormat(body);
+        serializeHeader(header);
+        buffers[0] = header.take();
+        buffers[1] = io.buffer();
+        body.swap(buffers[1]);
+        buffers[2] = documentFooter();
+        if (styles)
+        {
+            styles = std::make_shared<StyleSheet>();
+            body.setStyleSheet(styles.get());
+        }
+        return buffers;
+    }
+};
+
+// Document that keeps its shapes and caches the text of each, so that
+// saving again re-serializes only the shapes changed since, as told by
+// Shape::revision().  Changing the layout or formatting invalidates every
+// fragment.
+class RetainedDocument
+{
+   public:
+    explicit RetainedDocument(std::string const &file_name,
+                              const Layout &layout = Layout())
+        : file_name(file_name), layout(layout)
+    {
+    }
+
+    // Adds a copy of shape, returning it for later changes.
+    template <typename T>
+    std::shared_ptr<T> insert(T const &shape)
+    {
+        std::shared_ptr<T> copy = std::make_shared<T>(shape);
+        fragments.emplace_back(copy);
+        return copy;
+    }
+    RetainedDocument &operator<<(Shape const &shape)
+    {
+        fragments.emplace_back(shape.clone());
+        return *this;
+    }
+    // Removes a shape returned by insert().
+    bool erase(Shape const *shape)
+    {
+        auto found = std::find_if(fragments.begin(), fragments.end(),
+                                  [&](Fragment const &fragment)
+                                  { return fragment.shape.get() == shape; });
+        if (found == fragments.end()) return false;
+        fragments.erase(found);
         return true;
     }
+    size_t size() const { return fragments.size(); }
+
+    void setLayout(Layout const &new_layout)
+    {
+        layout = new_layout;
+        invalidate();
+    }
+    void setPrecision(Precision const &precision)
+    {
+        format.setPrecision(precision);
+        invalidate();
+    }
+    void setColorFormat(ColorFormat color_format)
+    {
+        format.setColorFormat(color_format);
+        invalidate();
+    }
+
+    // Number of shapes the next serialization will format.
+    size_t dirty() const
+    {
+        return std::count_if(fragments.begin(), fragments.end(),
+                             [](Fragment const &fragment)
+                             { return fragment.stale(); });
+    }
+    // Re-serializes the stale fragments, on pool.
+    void update(ThreadPool &pool = defaultThreadPool()) const
+    {
+        std::vector<Fragment *> stale;
+        for (Fragment &fragment : fragments)
+            if (fragment.stale()) stale.push_back(&fragment);
+        pool.parallelFor(stale.size(),
+                         [&](size_t i) { stale[i]->update(layout, format); });
+    }
+    std::string toString() const
+    {
+        update();
+        size_t size = 512;
+        for (Fragment const &fragment : fragments)
+            size += fragment.text.size();
+
+        Writer writer(size);
+        writer.setFormat(format);
+        serializeDocumentHeader(writer, layout);
+        for (Fragment const &fragment : fragments)
+            writer << fragment.text.str();
+        serializeDocumentFooter(writer);
+        return writer.take();
+    }
+    // Writes the cached fragments straight from their buffers.
+    bool save() const
+    {
+        update();
+        Writer header;
+        header.setFormat(format);
+        serializeDocumentHeader(header, layout);
+        std::string footer = documentFooter();
+
+        std::vector<std::string_view> pieces;
+        pieces.reserve(fragments.size() + 2);
+        pieces.push_back(header.str());
+        for (Fragment const &fragment : fragments)
+            pieces.push_back(fragment.text.str());
+        pieces.push_back(footer);
+        return writeFile(file_name, pieces).ok;
+    }
+
+    const std::string &filename() const { return file_name; }
+
+   private:
+    struct Fragment
+    {
+        explicit Fragment(std::shared_ptr<Shape> shape)
+            : shape(std::move(shape))
+        {
+        }
+
+        std::shared_ptr<Shape> shape;
+        Writer text;
+        bool valid = false;
+        size_t revision = 0;
+
+        bool stale() const { return !valid || revision != shape->revision(); }
+        void update(Layout const &layout, Writer const &format)
+        {
+            text.clear();
+            text.setFormat(format);
+            revision = shape->revision();
+            shape->serialize(text, layout);
+            valid = true;
+        }
+    };
+
+    std::string file_name;
+    Layout layout;
+    // Holds the formatting options only.
+    Writer format;
+    mutable std::vector<Fragment> fragments;
+
+    void invalidate()
+    {
+        for (Fragment &fragment : fragments) fragment.valid = false;
+    }
+};
+
+// Document that writes the prolog when opened and each shape as soon as it is
+// added, so memory use stays bounded however large the drawing grows.
+class StreamingDocument
+{
+   public:
+    explicit StreamingDocument(std::string const &file_name,
+                               const Layout &layout = Layout())
+        : file_name(file_name),
+          layout(layout),
+          file(std::make_unique<std::ofstream>(file_name.c_str())),
+          out(file.get())
+    {
+        serializeDocumentHeader(buffer, layout);
+    }
+    // Streams into a caller-owned sink which must outlive the document.
+    explicit StreamingDocument(std::ostream &sink,
+                               const Layout &layout = Layout())
+        : layout(layout), out(&sink)
+    {
+        serializeDocumentHeader(buffer, layout);
+    }
+    // Number formatting of the shapes inserted from now on.
+    void setPrecision(Precision const &precision)
+    {
+        buffer.setPrecision(precision);
+    }
+    // Color formatting of the shapes inserted from now on.
+    void setColorFormat(ColorFormat format) { buffer.setColorFormat(format); }
+    StreamingDocument(StreamingDocument const &) = delete;
+    StreamingDocument &operator=(StreamingDocument const &) = delete;
+    ~StreamingDocument() { close(); }
+
+    StreamingDocument &operator<<(Shape const &shape)
+    {
+        if (closed) return *this;
+
+        shape.serialize(buffer, layout);
+        if (buffer.size() >= flush_threshold) flush();
+        return *this;
+    }
+
+    // Writes the closing tag and flushes; further shapes are ignored.
+    bool close()
+    {
+        if (!closed)
+        {
+            closed = true;
+            serializeDocumentFooter(buffer);
+            flush();
+            out->flush();
+            if (file) file->close();
+        }
+        return good();
+    }
+    bool good() const { return file ? !file->fail() : out->good(); }
 
     const std::string &filename() const { return file_name; }
 
    private:
+    // Shapes are collected in a reusable buffer and handed to the output in
+    // blocks of about this size.
+    static constexpr size_t flush_threshold = 64 * 1024;
+
     std::string file_name;
     Layout layout;
+    std::unique_ptr<std::ofstream> file;
+    std::ostream *out;
+    Writer buffer{flush_threshold + 4096};
+    bool closed = false;
+
+    void flush()
+    {
+        out->write(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+};
 
-    std::string body_nodes_str;
+// Frames of one drawing in which only some layers change.  Static layers
+// are serialized once and shared by every frame; dynamic layers are drawn
+// for each frame by a callback, which must be safe to call concurrently for
+// different frames, since frames are emitted in parallel.
+class FrameSequence
+{
+   public:
+    // Draws frame's content of a layer into the empty group.
+    using DrawLayer = std::function<void(size_t frame, Group &layer)>;
+
+    explicit FrameSequence(Layout const &layout = Layout()) : layout(layout)
+    {
+    }
+    // Number and color formatting of the layers added from now on.
+    void setPrecision(Precision const &precision)
+    {
+        format.setPrecision(precision);
+    }
+    void setColorFormat(ColorFormat color_format)
+    {
+        format.setColorFormat(color_format);
+    }
+
+    // Adds a layer that is the same in every frame, serialized now.
+    FrameSequence &addStatic(Shape const &shape)
+    {
+        Layer layer;
+        layer.text.setFormat(format);
+        shape.serialize(layer.text, layout);
+        layers.push_back(std::move(layer));
+        return *this;
+    }
+    // Adds a layer drawn for each frame into a group with the given id.
+    FrameSequence &addDynamic(std::string const &id, DrawLayer draw)
+    {
+        Layer layer;
+        layer.text.setFormat(format);
+        layer.id = id;
+        layer.draw = std::move(draw);
+        layers.push_back(std::move(layer));
+        return *this;
+    }
+
+    void serializeFrame(Writer &writer, size_t frame) const
+    {
+        serializeDocumentHeader(writer, layout);
+        for (Layer const &layer : layers)
+        {
+            if (layer.draw)
+                serializeLayer(writer, layer, frame);
+            else
+                writer << layer.text.str();
+        }
+        serializeDocumentFooter(writer);
+    }
+    std::string frameToString(size_t frame) const
+    {
+        Writer writer(staticSize() + 512);
+        writer.setFormat(format);
+        serializeFrame(writer, frame);
+        return writer.take();
+    }
+    // Writes frames 0 to frame_count - 1 to the files named by
+    // file_name(frame).  Returns false if any frame could not be written.
+    bool save(size_t frame_count,
+              std::function<std::string(size_t)> const &file_name,
+              ThreadPool &pool = defaultThreadPool()) const
+    {
+        std::atomic<bool> ok{true};
+        pool.parallelFor(frame_count,
+                         [&](size_t frame)
+                         {
+                             std::string text = frameToString(frame);
+                             std::string_view pieces[] = {text};
+                             if (!writeFile(file_name(frame), pieces))
+                                 ok = false;
+                         });
+        return ok;
+    }
+
+    // One SVG showing frames 0 to frame_count - 1 in turn, frame_seconds
+    // each, through SMIL <set> elements; the last frame stays.  Static
+    // layers appear once, dynamic layers once per frame.
+    std::string animationToString(size_t frame_count, double frame_seconds,
+                                  ThreadPool &pool = defaultThreadPool()) const
+    {
+        // Text of each dynamic layer in each frame.
+        std::vector<std::vector<Writer>> frames(frame_count);
+        pool.parallelFor(
+            frame_count,
+            [&](size_t frame)
+            {
+                for (Layer const &layer : layers)
+                {
+                    if (!layer.draw) continue;
+                    Writer &writer = frames[frame].emplace_back();
+                    writer.setFormat(format);
+                    writer.elemStart("g").attribute("visibility", "hidden")
+                        << ">\n";
+                    writer.elemStart("set")
+                        .attribute("attributeName", "visibility")
+                        .attribute("to", "visible")
+                        .attribute("begin", clockValue(frame * frame_seconds));
+                    if (frame + 1 < frame_count)
+                        writer.attribute("dur", clockValue(frame_seconds));
+                    else
+                        writer.attribute("fill", "freeze");
+                    writer.emptyElemEnd();
+                    serializeLayer(writer, layer, frame);
+                    writer << '\t';
+                    writer.elemEnd("g");
+                }
+            });
+
+        Writer writer;
+        writer.setFormat(format);
+        serializeDocumentHeader(writer, layout);
+        size_t dynamic = 0;
+        for (Layer const &layer : layers)
+        {
+            if (!layer.draw)
+            {
+                writer << layer.text.str();
+                continue;
+            }
+            for (size_t frame = 0; frame < frame_count; ++frame)
+                writer << frames[frame][dynamic].str();
+            ++dynamic;
+        }
+        serializeDocumentFooter(writer);
+        return writer.take();
+    }
+
+   private:
+    struct Layer
+    {
+        Writer text;
+        std::string id;
+        DrawLayer draw;
+    };
+
+    Layout layout;
+    // Holds the formatting options only.
+    Writer format;
+    std::vector<Layer> layers;
+
+    void serializeLayer(Writer &writer, Layer const &layer,
+                        size_t frame) const
+    {
+        Group group(layer.id);
+        layer.draw(frame, group);
+        group.serialize(writer, layout);
+    }
+    size_t staticSize() const
+    {
+        size_t size = 0;
+        for (Layer const &layer : layers) size += layer.text.size();
+        return size;
+    }
+    // SMIL clock value to the millisecond, whatever the number precision.
+    static std::string clockValue(double seconds)
+    {
+        char chars[64];
+        auto [out, error] = std::to_chars(chars, chars + sizeof chars, seconds,
+                                          std::chars_format::fixed, 3);
+        if (error != std::errc()) return std::to_string(seconds) + 's';
+        while (out[-1] == '0') --out;
+        if (out[-1] == '.') --out;
+        return std::string(chars, out) + 's';
+    }
+};
+
+// Layout that shows the part of layout's canvas covered by region, scaled the
+// same, on a canvas of the region's size.
+Layout regionLayout(Layout const &layout, Box const &region)
+{
+    Size size(region.max.x - region.min.x, region.max.y - region.min.y);
+    Point origin_offset(
+        layout.origin_offset.x - region.min.x / layout.scale,
+        layout.origin_offset.y +
+            (size.height - layout.size.height + region.min.y) / layout.scale);
+    return Layout(size, layout.scale, origin_offset);
+}
+
+// Splits a scene into a grid of equally sized tiles and renders each as its
+// own SVG document holding only the shapes that intersect it.  The scene is
+// indexed once; tiles are rendered concurrently.
+class Tiler
+{
+   public:
+    Tiler(Group const &scene, Layout const &layout, Size const &tile_size)
+        : index(scene, layout),
+          tile_size(tile_size),
+          column_count(
+              size_t(std::ceil(layout.size.width / tile_size.width))),
+          row_count(size_t(std::ceil(layout.size.height / tile_size.height)))
+    {
+    }
+    // Number and color formatting of the tiles.
+    void setPrecision(Precision const &precision)
+    {
+        format.setPrecision(precision);
+    }
+    void setColorFormat(ColorFormat color_format)
+    {
+        format.setColorFormat(color_format);
+    }
+
+    size_t columns() const { return column_count; }
+    size_t rows() const { return row_count; }
+
+    // Area of the scene's canvas covered by a tile; row 0 is the top row.
+    Box tileBox(size_t column, size_t row) const
+    {
+        Point min(column * tile_size.width, row * tile_size.height);
+        return Box(min, Point(min.x + tile_size.width,
+                              min.y + tile_size.height));
+    }
+    void serializeTile(Writer &writer, size_t column, size_t row) const
+    {
+        Box box = tileBox(column, row);
+        Layout layout = regionLayout(index.getLayout(), box);
+        serializeDocumentHeader(writer, layout);
+        index.select(box).serialize(writer, layout);
+        serializeDocumentFooter(writer);
+    }
+    std::string tileToString(size_t column, size_t row) const
+    {
+        Writer writer;
+        writer.setFormat(format);
+        serializeTile(writer, column, row);
+        return writer.take();
+    }
+
+    // Writes every tile to the file named by file_name(column, row).
+    // Returns false if any tile could not be written.
+    bool save(std::function<std::string(size_t, size_t)> const &file_name,
+              ThreadPool &pool = defaultThreadPool()) const
+    {
+        std::atomic<bool> ok{true};
+        pool.parallelFor(
+            column_count * row_count,
+            [&](size_t tile)
+            {
+                size_t column = tile % column_count;
+                size_t row = tile / column_count;
+                Writer writer;
+                writer.setFormat(format);
+                serializeTile(writer, column, row);
+                std::string_view text[] = {writer.str()};
+                if (!writeFile(file_name(column, row), text)) ok = false;
+            });
+        return ok;
+    }
+
+   private:
+    SpatialIndex index;
+    Size tile_size;
+    size_t column_count;
+    size_t row_count;
+    // Holds the formatting options only.
+    Writer format;
 };
 }  // namespace svg
 
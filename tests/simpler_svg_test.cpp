@@ -34,8 +34,109 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include <gtest/gtest.h>
 
+#include <cmath>
+
 using namespace svg;
 
+// Test the Writer class
+TEST(WriterTest, Formatting)
+{
+    Writer w;
+    w << 8.333333333 << ' ' << 1e-7 << ' ' << 1234567.0 << ' ' << 42;
+    EXPECT_EQ(w.str(), "8.33333 1e-07 1.23457e+06 42");
+
+    w.clear();
+    w.fixed(-45).attribute("r", 2.5, "px").attribute("id", "a");
+    EXPECT_EQ(w.str(), "-45.000000r=\"2.5px\" id=\"a\" ");
+
+    Circle c(Point(50, 50), 30, Fill(Color::Red));
+    Layout l(Size(100, 100));
+    w.clear();
+    c.serialize(w, l);
+    EXPECT_EQ(w.str(), c.toString(l));
+}
+
+TEST(WriterTest, Precision)
+{
+    auto format = [](Precision const &precision, double value)
+    {
+        Writer w;
+        w.setPrecision(precision);
+        w << value;
+        return w.str();
+    };
+    EXPECT_EQ(format(Precision(), 0.5), "0.5");
+    EXPECT_EQ(format(Precision(Precision::Significant, 3), 123.456), "123");
+    EXPECT_EQ(format(Precision::decimals(2), 0.5), ".5");
+    EXPECT_EQ(format(Precision::decimals(2), -0.456), "-.46");
+    EXPECT_EQ(format(Precision::decimals(2), 12.0), "12");
+    EXPECT_EQ(format(Precision::decimals(2), -0.001), "0");
+    EXPECT_EQ(format(Precision::decimals(0), 2.5), "2");
+    EXPECT_EQ(format(Precision::decimals(3), 1e7), "10000000");
+    EXPECT_EQ(format(Precision::quantize(4), 3.1416), "3.25");
+    EXPECT_EQ(format(Precision::quantize(10), 0.07), ".1");
+    EXPECT_EQ(format(Precision::quantize(1), 1e22), "1e+22");
+
+    Writer w;
+    w.setPrecision(Precision::decimals(1));
+    w.fixed(-45);
+    EXPECT_EQ(w.str(), "-45");
+
+    Document doc("unused.svg", Layout(Size(100, 100)));
+    doc.setPrecision(Precision::decimals(1));
+    doc << Circle(Point(1.0 / 3, 0.25), 1, Fill());
+    EXPECT_NE(doc.toString().find("cx=\".3\" cy=\"99.8\" r=\".5\""),
+              std::string::npos);
+}
+
+// Test the point batch kernels against their scalar versions
+TEST(PointKernelTest, MatchesScalar)
+{
+    std::vector<Point> points;
+    for (int i = 0; i < 101; ++i)
+        points.push_back(Point(std::sin(i * 0.7) * 1e3, std::cos(i * 1.3) / 7));
+
+    Layout layout(Size(640, 480), 1.7, Point(-3.3, 11.1));
+    std::vector<double> expected(2 * points.size());
+    std::vector<double> actual(2 * points.size());
+    detail::translatePointsScalar(points.data(), points.size(), layout,
+                                  expected.data());
+    translatePoints(points.data(), points.size(), layout, actual.data());
+    EXPECT_EQ(actual, expected);
+    EXPECT_EQ(actual[1], translateY(points[0].y, layout));
+
+    for (size_t count = 1; count <= points.size(); count += 9)
+    {
+        Point min = detail::reducePointsScalar<false>(points.data(), count);
+        Point max = detail::reducePointsScalar<true>(points.data(), count);
+        std::vector<Point> prefix(points.begin(), points.begin() + count);
+        EXPECT_EQ(getMinPoint(prefix)->x, min.x);
+        EXPECT_EQ(getMinPoint(prefix)->y, min.y);
+        EXPECT_EQ(getMaxPoint(prefix)->x, max.x);
+        EXPECT_EQ(getMaxPoint(prefix)->y, max.y);
+    }
+
+    // A NaN gap is skipped, wherever it is, unless it comes first.
+    const double nan = std::nan("");
+    std::vector<Point> gap = {Point(5, 5), Point(nan, nan), Point(3, 3),
+                              Point(1, 1), Point(4, 4)};
+    EXPECT_EQ(getMinPoint(gap)->x, 1);
+    EXPECT_EQ(getMaxPoint(gap)->y, 5);
+    auto same = [](double a, double b)
+    { return a == b || (std::isnan(a) && std::isnan(b)); };
+    for (size_t position = 0; position < 9; ++position)
+    {
+        std::vector<Point> series(points.begin(), points.begin() + 9);
+        series[position] = Point(nan, nan);
+        Point min = detail::reducePointsScalar<false>(series.data(), 9);
+        Point max = detail::reducePointsScalar<true>(series.data(), 9);
+        EXPECT_TRUE(same(getMinPoint(series)->x, min.x)) << position;
+        EXPECT_TRUE(same(getMinPoint(series)->y, min.y)) << position;
+        EXPECT_TRUE(same(getMaxPoint(series)->x, max.x)) << position;
+        EXPECT_TRUE(same(getMaxPoint(series)->y, max.y)) << position;
+    }
+}
+
 // Test the Color class
 TEST(ColorTest, Constructor)
 {
@@ -43,6 +144,35 @@ TEST(ColorTest, Constructor)
     EXPECT_EQ(c.toString(), "rgb(100,150,200)");
 }
 
+TEST(ColorTest, Formats)
+{
+    auto format = [](Color const &color, ColorFormat color_format)
+    {
+        Writer writer;
+        writer.setColorFormat(color_format);
+        color.serialize(writer, Layout());
+        return writer.take();
+    };
+    EXPECT_EQ(Color(Color::Brown).toString(), "rgb(165,42,42)");
+    EXPECT_EQ(Color(Color::Transparent).toString(), "transparent");
+    EXPECT_EQ(Color(300, -5, 7).toString(), "rgb(255,0,7)");
+    EXPECT_EQ(Color(0, 0, 255, .5).toString(), "rgba(0,0,255,0.5)");
+    EXPECT_EQ(Color(Color::Red).withAlpha(.25).toString(),
+              "rgba(255,0,0,0.25)");
+    Writer coarse;
+    coarse.setPrecision(Precision::decimals(0));
+    Color(10, 20, 30, 0.5).serialize(coarse, Layout());
+    Color(255, 255, 255, 0.0004).serialize(coarse, Layout());
+    EXPECT_EQ(coarse.str(), "rgba(10,20,30,0.5)rgba(255,255,255,0)");
+
+    EXPECT_EQ(format(Color(Color::Red), ColorFormat::Hex), "#f00");
+    EXPECT_EQ(format(Color(Color::Brown), ColorFormat::Hex), "#a52a2a");
+    EXPECT_EQ(format(Color(17, 34, 51, 0.2), ColorFormat::Hex), "#1233");
+    EXPECT_EQ(format(Color(16, 34, 51, 0.5), ColorFormat::Hex), "#10223380");
+    EXPECT_EQ(format(Color(Color::Transparent), ColorFormat::Hex),
+              "transparent");
+}
+
 // Test the Fill class
 TEST(FillTest, Constructor)
 {
@@ -183,6 +313,95 @@ TEST(PolylineTest, Constructor)
         "\t<polyline points=\"0,200 100,200 100,100 0,100 \" "
         "fill=\"transparent\" />\n";
     EXPECT_EQ(polyline.toString(l), expected);
+
+    Polyline from_list(
+        {Point(0, 0), Point(100, 0), Point(100, 100), Point(0, 100)});
+    EXPECT_EQ(from_list.toString(l), expected);
+}
+
+TEST(PolylineTest, Bounds)
+{
+    Polyline polyline;
+    EXPECT_FALSE(polyline.minPoint());
+    EXPECT_FALSE(polyline.maxPoint());
+
+    polyline << Point(3, -1) << Point(-2, 4) << Point(5, 2);
+    EXPECT_EQ(polyline.minPoint()->x, -2);
+    EXPECT_EQ(polyline.minPoint()->y, -1);
+    EXPECT_EQ(polyline.maxPoint()->x, 5);
+    EXPECT_EQ(polyline.maxPoint()->y, 4);
+
+    polyline.offset(Point(10, 20));
+    EXPECT_EQ(polyline.minPoint()->x, 8);
+    EXPECT_EQ(polyline.maxPoint()->y, 24);
+
+    polyline.points.push_back(Point(100, 100));
+    polyline.updateBounds();
+    EXPECT_EQ(polyline.maxPoint()->x, 100);
+    EXPECT_EQ(polyline.maxPoint()->y, 100);
+}
+
+TEST(PolylineTest, Simplify)
+{
+    // A right angle drawn with sub-pixel jitter.
+    Polyline polyline;
+    for (int i = 0; i <= 100; ++i) polyline << Point(i, (i % 2) * 0.001);
+    for (int i = 1; i <= 100; ++i) polyline << Point(100, i);
+
+    std::vector<Polyline> polylines(4, polyline);
+    simplifyShapes(polylines, 0.5, Layout());
+    for (Polyline const &simplified : polylines)
+    {
+        ASSERT_EQ(simplified.points.size(), 3u);
+        EXPECT_EQ(simplified.points[1].x, 100);
+        EXPECT_EQ(simplified.points[1].y, 0);
+        EXPECT_EQ(simplified.maxPoint()->y, 100);
+    }
+
+    // At 100x scale the jitter is visible and is kept, while the straight
+    // vertical run still collapses to its end points.
+    polyline.simplify(0.5, Layout(Size(), 100));
+    EXPECT_EQ(polyline.points.size(), 102u);
+
+    Polygon square;
+    square << Point(0, 0) << Point(50, 0.001) << Point(100, 0)
+           << Point(100, 100) << Point(0, 100);
+    square.simplify(0.5, Layout(Size(200, 200)));
+    EXPECT_EQ(square.toString(Layout(Size(200, 200))),
+              "\t<polygon points=\"0,200 100,200 100,100 0,100 \" "
+              "fill=\"transparent\" />\n");
+}
+
+TEST(PolylineTest, PathEncoding)
+{
+    Layout l(Size(200, 200));
+    Polyline polyline(Stroke(1, Color::Black));
+    polyline.setEncoding(PointEncoding::Path);
+    polyline << Point(0, 0) << Point(100, 0) << Point(100, 0)
+             << Point(100, 100) << Point(0, 100) << Point(1.5, 102.5)
+             << Point(3, 105);
+    EXPECT_EQ(polyline.toString(l),
+              "\t<path d=\"M0 200h100v-100h-100l1.5-2.5 1.5-2.5\" "
+              "fill=\"transparent\" stroke-width=\"1\" "
+              "stroke=\"rgb(0,0,0)\" />\n");
+
+    Polygon polygon;
+    polygon.setEncoding(PointEncoding::Path);
+    polygon << Point(0, 0) << Point(0.5, 0.5) << Point(1, 1) << Point(1, 0);
+    Writer w;
+    w.setPrecision(Precision::decimals(1));
+    polygon.serialize(w, l);
+    EXPECT_EQ(w.str(),
+              "\t<path d=\"M0 200l.5-.5.5-.5v1z\" fill=\"transparent\" />\n");
+
+    // Steps are rounded from the rounded pen position, so the error does
+    // not accumulate.
+    Polyline steps;
+    steps.setEncoding(PointEncoding::Path);
+    for (int i = 0; i <= 30; ++i) steps << Point(i * 0.34, 0);
+    w.clear();
+    steps.serialize(w, Layout(Size(0, 0)));
+    EXPECT_EQ(w.str().substr(0, 30), "\t<path d=\"M0 0h.3.4.3.4.3.3.4.");
 }
 
 // Test the Text class
@@ -250,6 +469,117 @@ TEST(LineChartTest, Constructor)
         "fill=\"transparent\" stroke-width=\"0.5\" stroke=\"rgb(128,0,128)\" "
         "/>\n";
     EXPECT_EQ(chart.toString(l), expected);
+
+    // Points added to the vector directly draw the same chart.
+    LineChart direct;
+    Polyline filled;
+    for (Point const &point : polyline.points) filled.points.push_back(point);
+    direct << filled;
+    EXPECT_EQ(direct.toString(l), expected);
+}
+
+TEST(LineChartTest, Downsampling)
+{
+    Polyline series;
+    for (int i = 0; i < 10000; ++i)
+        series << Point(i * 0.05, i == 5000 ? 300 : std::sin(i * 0.01));
+
+    std::vector<Point> sampled = downsampleLTTB(series.points, 100);
+    ASSERT_EQ(sampled.size(), 100u);
+    EXPECT_EQ(sampled.front().x, series.points.front().x);
+    EXPECT_EQ(sampled.back().x, series.points.back().x);
+    EXPECT_TRUE(std::any_of(sampled.begin(), sampled.end(),
+                            [](Point const &p) { return p.y == 300; }));
+    EXPECT_EQ(downsampleLTTB(series.points, 20000).size(), 10000u);
+
+    // The series spans 500 px at scale 1, so at 2 points per pixel the
+    // chart draws 1000 vertices.
+    LineChart chart;
+    chart.setDownsampling(2);
+    chart << series;
+    std::string svg = chart.toString(Layout(Size(600, 600)));
+    size_t circles = 0;
+    for (size_t pos = svg.find("<circle"); pos != std::string::npos;
+         pos = svg.find("<circle", pos + 1))
+        ++circles;
+    EXPECT_EQ(circles, 1000u);
+}
+
+TEST(LineChartTest, LevelOfDetail)
+{
+    Polyline series;
+    for (int i = 0; i < 100000; ++i)
+        series << Point(i * 0.01, i == 54321 ? 300 : std::sin(i * 0.001));
+
+    PolylinePyramid pyramid(series.points);
+    std::vector<Point> view = pyramid.view(series.points, 0, 1000, 100);
+    EXPECT_LE(view.size(), 2 * 100u + 6);
+    EXPECT_GE(view.size(), 100u);
+    EXPECT_EQ(view.front().x, series.points.front().x);
+    EXPECT_EQ(view.back().x, series.points.back().x);
+    EXPECT_TRUE(std::is_sorted(view.begin(), view.end(),
+                               [](Point const &a, Point const &b)
+                               { return a.x < b.x; }));
+    EXPECT_TRUE(std::any_of(view.begin(), view.end(),
+                            [](Point const &p) { return p.y == 300; }));
+    auto lowest = [](std::vector<Point> const &points)
+    {
+        return std::min_element(points.begin(), points.end(),
+                                [](Point const &a, Point const &b)
+                                { return a.y < b.y; })
+            ->y;
+    };
+    EXPECT_EQ(lowest(view), lowest(std::vector<Point>(series.points.begin(),
+                                                     series.points.end())));
+
+    // A narrow range keeps every point, plus one beyond each end.
+    view = pyramid.view(series.points, 10, 10.5, 100);
+    ASSERT_EQ(view.size(), 53u);
+    EXPECT_DOUBLE_EQ(view.front().x, 9.99);
+    EXPECT_DOUBLE_EQ(view.back().x, 10.51);
+
+    // Only the 600 visible pixels of the 1000 px series are drawn.
+    LineChart chart;
+    chart.setLevelOfDetail(true);
+    chart << series;
+    std::string svg = chart.toString(Layout(Size(600, 600)));
+    size_t circles = 0;
+    for (size_t pos = svg.find("<circle"); pos != std::string::npos;
+         pos = svg.find("<circle", pos + 1))
+        ++circles;
+    EXPECT_GE(circles, 600u);
+    EXPECT_LE(circles, 1210u);
+}
+
+TEST(ShapeTest, Bounds)
+{
+    Layout l(Size(600, 600));
+    auto expectBox = [](std::optional<Box> box, Box expected)
+    {
+        ASSERT_TRUE(box);
+        EXPECT_DOUBLE_EQ(box->min.x, expected.min.x);
+        EXPECT_DOUBLE_EQ(box->min.y, expected.min.y);
+        EXPECT_DOUBLE_EQ(box->max.x, expected.max.x);
+        EXPECT_DOUBLE_EQ(box->max.y, expected.max.y);
+    };
+    expectBox(Circle(Point(300, 200), 50, Fill(Color::Red)).bounds(l),
+              Box(Point(275, 375), Point(325, 425)));
+    expectBox(Rectangle(Point(100, 100), 200, 150).bounds(l),
+              Box(Point(100, 350), Point(300, 500)));
+    expectBox(Line(Point(0, 0), Point(10, 20), Stroke(2, Color::Black))
+                  .bounds(l),
+              Box(Point(-1, 579), Point(11, 601)));
+
+    Polyline polyline;
+    EXPECT_FALSE(polyline.bounds(l));
+    polyline << Point(10, 10) << Point(20, 40);
+    expectBox(polyline.bounds(l), Box(Point(10, 560), Point(20, 590)));
+
+    Group group;
+    group << polyline << Circle(Point(0, 0), 2, Fill());
+    expectBox(group.bounds(l), Box(Point(-1, 560), Point(20, 601)));
+    group << Text(Point(0, 0), "label");
+    EXPECT_TRUE(group.bounds(l)->contains(Point(0, 600)));
 }
 
 // Test the Group class
@@ -273,6 +603,404 @@ TEST(GroupTest, Constructor)
     EXPECT_EQ(group.toString(l), expected);
 }
 
+TEST(GroupTest, CopyOnWrite)
+{
+    Group inner("inner");
+    inner << Circle(Point(10, 10), 4, Fill(Color::Red));
+    auto shared = std::make_shared<const Group>(inner);
+
+    Group a("a");
+    a << shared << Rectangle(Point(0, 0), 2, 2, Fill(Color::Blue));
+    Group b = a;
+    Group c;
+    c = a;
+
+    Layout l(Size(100, 100));
+    std::string original = a.toString(l);
+    b.offset(Point(5, 5));
+    EXPECT_EQ(a.toString(l), original);
+    EXPECT_EQ(c.toString(l), original);
+    EXPECT_EQ(shared->toString(l), inner.toString(l));
+    EXPECT_NE(b.toString(l), original);
+
+    a.offset(Point(5, 5));
+    EXPECT_EQ(a.toString(l), b.toString(l));
+    EXPECT_EQ(shared->toString(l), inner.toString(l));
+
+    // A node inserted by pointer is replaced by a clone rather than
+    // modified, even when the group holds the only reference to it.
+    auto node = std::make_shared<const Circle>(Point(1, 1), 1, Fill());
+    std::weak_ptr<const Circle> observer = node;
+    Group d;
+    d << std::move(node);
+    d.offset(Point(5, 5));
+    EXPECT_TRUE(observer.expired());
+    EXPECT_NE(d.toString(l).find("cx=\"6\""), std::string::npos);
+}
+
+TEST(GroupTest, MemoryResource)
+{
+    std::pmr::monotonic_buffer_resource arena;
+    Layout l(Size(100, 100));
+    Polyline polyline;
+    polyline << Point(1, 2) << Point(3, 4) << Point(5, 6);
+
+    Group heap;
+    Group group("scene", &arena);
+    for (int i = 0; i < 100; ++i)
+    {
+        heap << polyline << Circle(Point(i, i), 2, Fill(Color::Red));
+        group << polyline << Circle(Point(i, i), 2, Fill(Color::Red));
+    }
+    group << heap;
+
+    auto clone = polyline.cloneInto(&arena);
+    EXPECT_EQ(static_cast<Polyline &>(*clone).points.get_allocator().resource(),
+              &arena);
+
+    Group copy = group;
+    copy.offset(Point(1, 1));
+    heap << heap;
+    group.offset(Point(1, 1));
+    EXPECT_EQ(copy.toString(l), group.toString(l));
+}
+
+TEST(GroupTest, ParallelSerialize)
+{
+    ThreadPool pool(4);
+    Group group("many");
+    std::vector<Circle> circles;
+    for (int i = 0; i < 5000; ++i)
+    {
+        circles.push_back(Circle(Point(i % 70, i / 70), 3, Fill(Color::Red)));
+        group << circles.back();
+    }
+    group << Group("nested");
+
+    Layout l(Size(600, 600));
+    EXPECT_EQ(group.toString(l, pool), group.toString(l));
+
+    Document sequential("unused.svg", l);
+    Document parallel("unused.svg", l);
+    for (Circle const &circle : circles) sequential << circle;
+    parallel.insert(circles, pool);
+    EXPECT_EQ(parallel.toString(), sequential.toString());
+}
+
+TEST(GroupTest, Culling)
+{
+    Layout l(Size(100, 100));
+    std::vector<Circle> circles;
+    for (int i = 0; i < 1000; ++i)
+        circles.push_back(Circle(Point(i, 50), 4, Fill(Color::Red)));
+
+    Group group;
+    for (Circle const &circle : circles) group << circle;
+    group.setCulling(true);
+    std::string culled = group.toString(l);
+    size_t count = 0;
+    for (size_t pos = culled.find("<circle"); pos != std::string::npos;
+         pos = culled.find("<circle", pos + 1))
+        ++count;
+    // Circles reaching into [0, 100], i.e. centres up to x = 102.
+    EXPECT_EQ(count, 103u);
+    ThreadPool pool(4);
+    EXPECT_EQ(group.toString(l, pool), culled);
+
+    // Copies, and so nested groups, keep culling.
+    Group outer;
+    outer << group;
+    Group assigned;
+    assigned = group;
+    EXPECT_EQ(assigned.toString(l), culled);
+    EXPECT_EQ(outer.toString(l).find("cx=\"500\""), std::string::npos);
+
+    Document document("unused.svg", l);
+    document.setCulling(true);
+    document.insert(circles, pool);
+    document << Circle(Point(500, 500), 4, Fill(Color::Red));
+    Document visible("unused.svg", l);
+    for (size_t i = 0; i < 103; ++i) visible << circles[i];
+    EXPECT_EQ(document.toString(), visible.toString());
+
+    // A polyline filled through its points vector is not culled.
+    Layout shifted(Size(10, 10), 1, Point(-100, -100));
+    Polyline direct;
+    direct.points.push_back(Point(102, 102));
+    direct.points.push_back(Point(108, 108));
+    Document drawn("unused.svg", shifted);
+    drawn.setCulling(true);
+    drawn << direct;
+    EXPECT_NE(drawn.toString().find("<polyline"), std::string::npos);
+    Group holder;
+    holder << direct;
+    SpatialIndex index(holder, shifted);
+    EXPECT_EQ(index.intersecting(canvasBox(shifted)).size(), 1u);
+}
+
+TEST(SpatialIndexTest, Queries)
+{
+    Layout l(Size(1000, 1000));
+    Group group("scene");
+    for (int i = 0; i < 2000; ++i)
+    {
+        double x = (i * 7919) % 1000, y = (i * 104729) % 1000;
+        if (i % 3 == 0)
+            group << Circle(Point(x, y), 2 + i % 7, Fill(Color::Red));
+        else
+            group << Rectangle(Point(x, y), 5, 3 + i % 11, Fill(Color::Blue));
+    }
+    group << Group("empty");
+    SpatialIndex index(group, l);
+    ASSERT_EQ(index.size(), group.size());
+
+    auto bruteForce = [&](Box const &region)
+    {
+        std::vector<size_t> found;
+        for (size_t i = 0; i < group.size(); ++i)
+        {
+            std::optional<Box> box = group.children()[i]->bounds(l);
+            if (!box || box->intersects(region)) found.push_back(i);
+        }
+        return found;
+    };
+    for (Box region : {Box(Point(100, 100), Point(200, 300)),
+                       Box(Point(-50, -50), Point(10, 2000)),
+                       Box(Point(2000, 0), Point(3000, 10)),
+                       Box(Point(0, 0), Point(1000, 1000))})
+        EXPECT_EQ(index.intersecting(region), bruteForce(region));
+    Point point(500.5, 500.5);
+    EXPECT_EQ(index.containing(point), bruteForce(Box(point, point)));
+
+    group.setCulling(true);
+    Writer writer;
+    index.serialize(writer, canvasBox(l));
+    EXPECT_EQ(writer.str(), group.toString(l));
+}
+
+TEST(ValueGroupTest, MatchesGroup)
+{
+    Layout l(Size(600, 600));
+    Group group("shapes");
+    ValueGroup values("shapes");
+    std::vector<ValueGroup::value_type> items;
+    Polyline polyline(Stroke(1, Color::Blue));
+    polyline << Point(1, 2) << Point(3, 4);
+    for (int i = 0; i < 300; ++i)
+    {
+        Circle circle(Point(i, i), 4, Fill(Color::Red));
+        Rectangle rectangle(Point(i, 2 * i), 3, 5, Fill(Color::Blue));
+        Text text(Point(i, 0), "t", Font(8));
+        group << circle << rectangle << polyline << text;
+        values << circle << rectangle << polyline << text;
+        items.insert(items.end(), {circle, rectangle, polyline, text});
+    }
+    EXPECT_EQ(values.size(), 1200u);
+    EXPECT_EQ(values.toString(l), group.toString(l));
+    ThreadPool pool(4);
+    Writer parallel;
+    values.serialize(parallel, l, pool);
+    EXPECT_EQ(parallel.str(), group.toString(l));
+    ASSERT_TRUE(values.bounds(l));
+    EXPECT_DOUBLE_EQ(values.bounds(l)->min.x, group.bounds(l)->min.x);
+
+    values.offset(Point(5, -5));
+    group.offset(Point(5, -5));
+    EXPECT_EQ(values.toString(l), group.toString(l));
+
+    Group outer;
+    outer << values;
+    std::unique_ptr<Shape> copy = values.clone();
+    EXPECT_EQ(copy->toString(l), group.toString(l));
+
+    Document sequential("unused.svg", l);
+    Document batch("unused.svg", l);
+    for (auto const &item : items) sequential << detail::asShape(item);
+    batch.insert(items, pool);
+    EXPECT_EQ(batch.toString(), sequential.toString());
+}
+
+TEST(BatchTest, MatchesShapes)
+{
+    Layout l(Size(600, 600), 1.5);
+    CircleBatch circles(Fill(Color::Red), Stroke(2, Color::Black));
+    CircleBatch colored(Fill(), Stroke(1, Color::Blue));
+    RectBatch rects(Fill(Color::Green));
+    for (int i = 0; i < 600; ++i)
+    {
+        Point point(i * 0.7, 400 - i * 0.3);
+        circles.add(point, 3 + i % 5);
+        colored.add(point, 2, Color(i % 256, 0, 255 - i % 256));
+        rects.add(point, 4, 1 + i % 3);
+    }
+    EXPECT_EQ(circles.size(), 600u);
+    auto addShapes = [](Document &doc)
+    {
+        for (int i = 0; i < 600; ++i)
+            doc << Circle(Point(i * 0.7, 400 - i * 0.3), 3 + i % 5,
+                          Fill(Color::Red), Stroke(2, Color::Black));
+        for (int i = 0; i < 600; ++i)
+            doc << Circle(Point(i * 0.7, 400 - i * 0.3), 2,
+                          Fill(Color(i % 256, 0, 255 - i % 256)),
+                          Stroke(1, Color::Blue));
+        for (int i = 0; i < 600; ++i)
+            doc << Rectangle(Point(i * 0.7, 400 - i * 0.3), 4, 1 + i % 3,
+                             Fill(Color::Green));
+    };
+
+    for (bool interning : {false, true})
+    {
+        Document expected("unused.svg", l);
+        Document batched("unused.svg", l);
+        expected.setStyleInterning(interning);
+        batched.setStyleInterning(interning);
+        addShapes(expected);
+        batched << circles << colored << rects;
+        EXPECT_EQ(batched.toString(), expected.toString());
+    }
+
+    Group group;
+    group << circles;
+    circles.offset(Point(1, 1));
+    EXPECT_NE(group.toString(l).find("cx=\"0\" cy=\"0\" r=\"2.25\""),
+              std::string::npos);
+    ASSERT_TRUE(rects.bounds(l));
+    EXPECT_DOUBLE_EQ(rects.bounds(l)->min.x, 0);
+
+    // Items without a color take the batch fill once others have one.
+    CircleBatch mixed(Fill(Color::Red));
+    mixed.add(Point(1, 1), 2).add(Point(2, 2), 2, Color(Color::Blue));
+    mixed.add(Point(3, 3), 2);
+    RectBatch mixed_rects(Fill(Color::Red));
+    mixed_rects.add(Point(1, 1), 2, 2)
+        .add(Point(2, 2), 2, 2, Color(Color::Blue));
+    mixed_rects.add(Point(3, 3), 2, 2);
+    Document expected("unused.svg", l);
+    Document batched("unused.svg", l);
+    expected << Circle(Point(1, 1), 2, Fill(Color::Red))
+             << Circle(Point(2, 2), 2, Fill(Color::Blue))
+             << Circle(Point(3, 3), 2, Fill(Color::Red))
+             << Rectangle(Point(1, 1), 2, 2, Fill(Color::Red))
+             << Rectangle(Point(2, 2), 2, 2, Fill(Color::Blue))
+             << Rectangle(Point(3, 3), 2, 2, Fill(Color::Red));
+    batched << mixed << mixed_rects;
+    EXPECT_EQ(batched.toString(), expected.toString());
+}
+
+// Test the FrameSequence class
+TEST(FrameSequenceTest, Frames)
+{
+    Layout layout(Size(100, 100));
+    Rectangle background(Point(0, 0), 100, 100, Fill(Color::White));
+    Text label(Point(5, 5), "label");
+    auto draw = [](size_t frame, Group &layer)
+    { layer << Circle(Point(10 * frame, 50), 4, Fill(Color::Red)); };
+
+    FrameSequence frames(layout);
+    frames.addStatic(background).addDynamic("dot", draw).addStatic(label);
+    for (size_t frame = 0; frame < 3; ++frame)
+    {
+        Group layer("dot");
+        draw(frame, layer);
+        Document doc("unused.svg", layout);
+        doc << background << layer << label;
+        EXPECT_EQ(frames.frameToString(frame), doc.toString());
+    }
+
+    ThreadPool pool(2);
+    auto name = [](size_t frame)
+    { return "frame_" + std::to_string(frame) + ".svg"; };
+    ASSERT_TRUE(frames.save(3, name, pool));
+    for (size_t frame = 0; frame < 3; ++frame)
+    {
+        std::ifstream file(name(frame));
+        std::stringstream contents;
+        contents << file.rdbuf();
+        file.close();
+        EXPECT_EQ(contents.str(), frames.frameToString(frame));
+        std::remove(name(frame).c_str());
+    }
+
+    std::string animation = frames.animationToString(3, 0.5, pool);
+    auto count = [&](std::string const &text)
+    {
+        size_t found = 0;
+        for (size_t pos = animation.find(text); pos != std::string::npos;
+             pos = animation.find(text, pos + 1))
+            ++found;
+        return found;
+    };
+    EXPECT_EQ(count("<rect "), 1u);
+    EXPECT_EQ(count("<circle "), 3u);
+    EXPECT_EQ(count("<set "), 3u);
+    EXPECT_EQ(count("fill=\"freeze\""), 1u);
+    EXPECT_NE(animation.find("begin=\"1s\" fill=\"freeze\""),
+              std::string::npos);
+    EXPECT_LT(animation.find("<rect "), animation.find("<circle "));
+    EXPECT_GT(animation.find("<text "), animation.rfind("<circle "));
+
+    // Times keep their precision when coordinates are rounded.
+    frames.setPrecision(Precision::decimals(0));
+    animation = frames.animationToString(3, 0.25, pool);
+    EXPECT_NE(animation.find("begin=\"0.25s\" dur=\"0.25s\""),
+              std::string::npos);
+    EXPECT_NE(animation.find("begin=\"0.5s\" fill=\"freeze\""),
+              std::string::npos);
+}
+
+// Test the Tiler class
+TEST(TilerTest, Tiles)
+{
+    Layout l(Size(200, 200));
+    Group scene("scene");
+    scene << Circle(Point(50, 150), 10, Fill(Color::Red))
+          << Circle(Point(100, 100), 20, Fill(Color::Blue));
+    Tiler tiler(scene, l, Size(100, 100));
+    ASSERT_EQ(tiler.columns(), 2u);
+    ASSERT_EQ(tiler.rows(), 2u);
+
+    std::string top_left = tiler.tileToString(0, 0);
+    std::string bottom_right = tiler.tileToString(1, 1);
+    EXPECT_NE(top_left.find("width=\"100px\""), std::string::npos);
+    EXPECT_NE(top_left.find("<circle cx=\"50\" cy=\"50\" r=\"5\""),
+              std::string::npos);
+    EXPECT_NE(top_left.find("<circle cx=\"100\" cy=\"100\" r=\"10\""),
+              std::string::npos);
+    EXPECT_EQ(bottom_right.find("r=\"5\""), std::string::npos);
+    EXPECT_NE(bottom_right.find("<circle cx=\"0\" cy=\"0\" r=\"10\""),
+              std::string::npos);
+
+    ThreadPool pool(2);
+    auto name = [](size_t column, size_t row)
+    { return "tile_" + std::to_string(column) + "_" + std::to_string(row); };
+    ASSERT_TRUE(tiler.save(name, pool));
+    for (size_t row = 0; row < 2; ++row)
+        for (size_t column = 0; column < 2; ++column)
+        {
+            std::ifstream file(name(column, row));
+            std::stringstream contents;
+            contents << file.rdbuf();
+            file.close();
+            EXPECT_EQ(contents.str(), tiler.tileToString(column, row));
+            std::remove(name(column, row).c_str());
+        }
+}
+
+// Test the ThreadPool class
+TEST(ThreadPoolTest, ParallelFor)
+{
+    ThreadPool pool(3);
+    std::vector<int> values(10007, 0);
+    pool.parallelFor(values.size(), [&](size_t i) { values[i] += int(i); });
+    for (size_t i = 0; i < values.size(); ++i) ASSERT_EQ(values[i], int(i));
+
+    // Nested loops run without deadlocking.
+    std::atomic<int> count{0};
+    pool.parallelFor(8, [&](size_t)
+                     { pool.parallelFor(100, [&](size_t) { ++count; }); });
+    EXPECT_EQ(count, 800);
+}
+
 // Test the Document class
 TEST(DocumentTest, SaveAndLoad)
 {
@@ -292,6 +1020,250 @@ TEST(DocumentTest, SaveAndLoad)
     std::remove("test.svg");
 }
 
+TEST(DocumentTest, SaveWritesPieces)
+{
+    auto contents = [](char const *file_name)
+    {
+        std::ifstream file(file_name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), {});
+    };
+
+    Layout layout(Size(100, 100));
+    Document doc("pieces.svg", layout);
+    doc << Circle(Point(50, 50), 30, Fill(Color::Red));
+    EXPECT_TRUE(doc.save());
+    EXPECT_EQ(contents("pieces.svg"), doc.toString());
+
+    // More fragments than a single writev call accepts
+    RetainedDocument retained("pieces.svg", layout);
+    for (int i = 0; i < 3000; ++i)
+        retained << Circle(Point(i % 100, i / 30), 1, Fill(Color::Blue));
+    EXPECT_TRUE(retained.save());
+    EXPECT_EQ(contents("pieces.svg"), retained.toString());
+    std::remove("pieces.svg");
+
+    Document missing("no_such_directory/pieces.svg", layout);
+    EXPECT_FALSE(missing.save());
+}
+
+TEST(DocumentTest, SaveAsync)
+{
+    auto contents = [](std::string const &file_name)
+    {
+        std::ifstream file(file_name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), {});
+    };
+
+    Layout layout(Size(100, 100));
+    Document empty("unused.svg", layout);
+    std::vector<std::string> expected;
+    std::vector<std::future<SaveResult>> results;
+    {
+        FileWriter io;
+        for (int frame = 0; frame < 4; ++frame)
+        {
+            Document doc("async" + std::to_string(frame) + ".svg", layout);
+            for (int i = 0; i <= frame; ++i)
+                doc << Circle(Point(10 * i, 50), 5, Fill(Color::Red));
+            expected.push_back(doc.toString());
+            results.push_back(doc.saveAsync(io));
+            EXPECT_EQ(doc.toString(), empty.toString());
+        }
+
+        // One document rebuilt in the buffer of a written one.
+        Document reused("async4.svg", layout);
+        reused.setStyleInterning(true);
+        reused << Circle(Point(50, 50), 5, Fill(Color::Blue));
+        expected.push_back(reused.toString());
+        SaveResult reported;
+        reused.saveAsync(io, [&](SaveResult const &result)
+                         { reported = result; });
+        io.flush();
+        EXPECT_TRUE(reported);
+        EXPECT_EQ(reported.bytes_written, expected.back().size());
+
+        Document missing("no_such_directory/async.svg", layout);
+        EXPECT_FALSE(missing.saveAsync(io).get());
+    }
+
+    for (size_t frame = 0; frame < expected.size(); ++frame)
+    {
+        std::string file_name = "async" + std::to_string(frame) + ".svg";
+        if (frame < results.size())
+        {
+            SaveResult result = results[frame].get();
+            EXPECT_TRUE(result);
+            EXPECT_EQ(result.bytes_written, expected[frame].size());
+        }
+        EXPECT_EQ(contents(file_name), expected[frame]);
+        std::remove(file_name.c_str());
+    }
+}
+
+TEST(DocumentTest, StyleInterning)
+{
+    Layout layout(Size(100, 100));
+    Document doc("unused.svg", layout);
+    doc.setStyleInterning(true);
+    doc << Circle(Point(10, 20), 4, Fill(Color::Red))
+        << Rectangle(Point(1, 2), 3, 4, Fill(Color::Blue),
+                     Stroke(1, Color::Black))
+        << Circle(Point(30, 40), 4, Fill(Color::Red))
+        << Line(Point(0, 0), Point(1, 1))
+        << Text(Point(5, 5), "label", Font(10, "Arial"));
+    std::string svg = doc.toString();
+    EXPECT_NE(svg.find("<style type=\"text/css\">\n"
+                       "\t\t.s0{fill:rgb(255,0,0);}\n"
+                       "\t\t.s1{fill:rgb(0,0,255);stroke-width:1;"
+                       "stroke:rgb(0,0,0);}\n"
+                       "\t\t.s2{fill:transparent;font-size:10px;"
+                       "font-family:Arial;}\n"
+                       "\t</style>\n"),
+              std::string::npos);
+    EXPECT_NE(svg.find("<circle cx=\"30\" cy=\"60\" r=\"2\" "
+                       "class=\"s0\" />"),
+              std::string::npos);
+    EXPECT_NE(svg.find("<line x1=\"0\" y1=\"100\" x2=\"1\" y2=\"99\" />"),
+              std::string::npos);
+    EXPECT_EQ(svg.find("fill=\""), std::string::npos);
+
+    std::vector<Circle> circles;
+    for (int i = 0; i < 1000; ++i)
+        circles.push_back(Circle(Point(i % 100, i / 10), 2,
+                                 Fill(i % 3 ? Color::Red : Color::Blue)));
+    ThreadPool pool(4);
+    Document sequential("unused.svg", layout);
+    Document parallel("unused.svg", layout);
+    sequential.setStyleInterning(true);
+    parallel.setStyleInterning(true);
+    for (Circle const &circle : circles) sequential << circle;
+    parallel.insert(circles, pool);
+    EXPECT_EQ(parallel.toString(), sequential.toString());
+}
+
+TEST(RetainedDocumentTest, ReserializesChangedShapes)
+{
+    Layout layout(Size(200, 200));
+    RetainedDocument retained("unused.svg", layout);
+    std::vector<std::shared_ptr<Polyline>> series;
+    for (int i = 0; i < 10; ++i)
+    {
+        Polyline polyline(Stroke(1, Color::Blue));
+        for (int x = 0; x < 100; ++x) polyline << Point(x, i * 10 + x % 7);
+        series.push_back(retained.insert(polyline));
+    }
+    std::shared_ptr<Text> title = retained.insert(Text(Point(5, 190), "t"));
+    retained << Circle(Point(50, 50), 10, Fill(Color::Red));
+    EXPECT_EQ(retained.dirty(), 12u);
+
+    auto expected = [&]
+    {
+        Document doc("unused.svg", layout);
+        for (auto const &polyline : series) doc << *polyline;
+        doc << *title << Circle(Point(50, 50), 10, Fill(Color::Red));
+        return doc.toString();
+    };
+    EXPECT_EQ(retained.toString(), expected());
+    EXPECT_EQ(retained.dirty(), 0u);
+
+    series[3]->offset(Point(1, 1));
+    *series[4] << Point(100, 0);
+    title->setRotation(90);
+    EXPECT_EQ(retained.dirty(), 3u);
+    EXPECT_EQ(retained.toString(), expected());
+
+    *series[5] = *series[6];
+    EXPECT_EQ(retained.dirty(), 1u);
+    EXPECT_TRUE(retained.erase(series[0].get()));
+    series.erase(series.begin());
+    EXPECT_EQ(retained.toString(), expected());
+
+    layout = Layout(Size(100, 100), 0.5);
+    retained.setLayout(layout);
+    EXPECT_EQ(retained.dirty(), retained.size());
+    EXPECT_EQ(retained.toString(), expected());
+}
+
+// Test the StreamingDocument class
+TEST(StreamingDocumentTest, MatchesDocument)
+{
+    Layout layout(Size(100, 100));
+    Document doc("unused.svg", layout);
+    std::stringstream sink;
+    {
+        StreamingDocument stream(sink, layout);
+        for (int i = 0; i < 3; ++i)
+        {
+            Circle c(Point(10 * i, 20), 30, Fill(Color::Red));
+            doc << c;
+            stream << c;
+        }
+        EXPECT_TRUE(stream.close());
+        stream << Circle(Point(0, 0), 1, Fill());
+    }
+    EXPECT_EQ(sink.str(), doc.toString());
+}
+
+TEST(StreamingDocumentTest, WritesFile)
+{
+    {
+        StreamingDocument doc("stream_test.svg", Layout(Size(100, 100)));
+        doc << Rectangle(Point(10, 20), 50, 30, Fill(Color::Green));
+    }
+
+    std::ifstream file("stream_test.svg");
+    std::stringstream contents;
+    contents << file.rdbuf();
+    file.close();
+    EXPECT_NE(contents.str().find("<rect "), std::string::npos);
+    EXPECT_EQ(contents.str().substr(contents.str().size() - 7), "</svg>\n");
+
+    std::remove("stream_test.svg");
+}
+
+#ifdef SIMPLER_SVG_USE_ZLIB
+std::string readGzipFile(std::string const &file_name)
+{
+    std::string text;
+    gzFile file = gzopen(file_name.c_str(), "rb");
+    char chunk[4096];
+    for (int count; (count = gzread(file, chunk, sizeof(chunk))) > 0;)
+        text.append(chunk, count);
+    gzclose(file);
+    return text;
+}
+
+TEST(DocumentTest, SaveCompressed)
+{
+    Document doc("test.svgz", Layout(Size(100, 100)));
+    for (int i = 0; i < 20000; ++i)
+        doc << Circle(Point(i % 100, i / 200), 3, Fill(Color::Red));
+
+    EXPECT_TRUE(doc.saveCompressed(9));
+    EXPECT_EQ(readGzipFile("test.svgz"), doc.toString());
+    std::remove("test.svgz");
+}
+
+TEST(StreamingDocumentTest, Compressed)
+{
+    Layout layout(Size(100, 100));
+    Document doc("unused.svg", layout);
+    GzipOfstream out("stream_test.svgz", 1);
+    {
+        StreamingDocument stream(out, layout);
+        for (int i = 0; i < 20000; ++i)
+        {
+            Rectangle r(Point(i % 100, i / 200), 2, 2, Fill(Color::Blue));
+            doc << r;
+            stream << r;
+        }
+    }
+    EXPECT_TRUE(out.close());
+    EXPECT_EQ(readGzipFile("stream_test.svgz"), doc.toString());
+    std::remove("stream_test.svgz");
+}
+#endif
+
 int main(int argc, char **argv)
 {
     testing::InitGoogleTest(&argc, argv);